@@ -35,9 +35,29 @@
 #include <stdlib.h> /* malloc(3) realloc(3) free(3) abort(3) */
 #include <string.h> /* memset(3) memmove(3) */
 
+#if _WIN32
+#include <windows.h> /* LARGE_INTEGER QueryPerformanceCounter(3) QueryPerformanceFrequency(3) */
+#else
+#include <time.h>   /* CLOCK_MONOTONIC clock_gettime(3) */
+#include <sys/uio.h> /* struct iovec */
+#include <sys/mman.h> /* mmap(2) munmap(2) posix_madvise(3) */
+#include <sys/stat.h> /* struct stat fstat(2) S_ISREG */
+#include <unistd.h> /* off_t lseek(2) read(2) write(2) sysconf(3) */
+#endif
+
 #include "hexdump.h"
 
 
+#if HEXDUMP_BENCH
+/* count allocator calls made by the library */
+static unsigned long hxd_nalloc;
+
+#define malloc(n) (++hxd_nalloc, malloc((n)))
+#define calloc(n, m) (++hxd_nalloc, calloc((n), (m)))
+#define realloc(p, n) (++hxd_nalloc, realloc((p), (n)))
+#endif
+
+
 #define SAY_(fmt, ...) fprintf(stderr, fmt "%s", __FILE__, __LINE__, __func__, __VA_ARGS__);
 #define SAY(...) SAY_("@@ %s:%d:%s: " __VA_ARGS__, "\n");
 #define HAI SAY("HAI")
@@ -116,6 +136,85 @@ static unsigned char toprint(unsigned char chr) {
 } /* toprint() */
 
 
+#if defined __BYTE_ORDER__ && defined __ORDER_LITTLE_ENDIAN__ && defined __ORDER_BIG_ENDIAN__
+#define HOST_LITTLE_ENDIAN (__BYTE_ORDER__ == __ORDER_LITTLE_ENDIAN__)
+#define HOST_BIG_ENDIAN (__BYTE_ORDER__ == __ORDER_BIG_ENDIAN__)
+#elif defined _WIN32 || defined __i386__ || defined __x86_64__
+#define HOST_LITTLE_ENDIAN 1
+#define HOST_BIG_ENDIAN 0
+#else
+#define HOST_LITTLE_ENDIAN 0
+#define HOST_BIG_ENDIAN 0
+#endif
+
+#if __GNUC__
+#define bswap16(x) __builtin_bswap16(x)
+#define bswap32(x) __builtin_bswap32(x)
+#define bswap64(x) __builtin_bswap64(x)
+#else
+static inline uint16_t bswap16(uint16_t x) {
+	return (x << 8) | (x >> 8);
+} /* bswap16() */
+
+static inline uint32_t bswap32(uint32_t x) {
+	return ((uint32_t)bswap16(x) << 16) | bswap16(x >> 16);
+} /* bswap32() */
+
+static inline uint64_t bswap64(uint64_t x) {
+	return ((uint64_t)bswap32(x) << 32) | bswap32(x >> 32);
+} /* bswap64() */
+#endif
+
+
+/*
+ * Load an n-octet word in the specified byte order. Words of 2, 4, and 8
+ * octets are fetched with a single unaligned load when the host byte order
+ * is known. Octets beyond the eighth are consumed but ignored.
+ */
+static inline uint64_t loadword(const unsigned char *p, size_t n, _Bool big) {
+	uint64_t v = 0;
+	size_t i;
+
+	if (HOST_LITTLE_ENDIAN || HOST_BIG_ENDIAN) {
+		_Bool swap = (HOST_BIG_ENDIAN)? !big : big;
+
+		switch (n) {
+		case 2: {
+			uint16_t w;
+
+			memcpy(&w, p, sizeof w);
+
+			return (swap)? bswap16(w) : w;
+		}
+		case 4: {
+			uint32_t w;
+
+			memcpy(&w, p, sizeof w);
+
+			return (swap)? bswap32(w) : w;
+		}
+		case 8: {
+			uint64_t w;
+
+			memcpy(&w, p, sizeof w);
+
+			return (swap)? bswap64(w) : w;
+		}
+		}
+	}
+
+	if (big) {
+		for (i = 0; i < n; i++)
+			v = (v << 8) | p[i];
+	} else {
+		for (i = MIN(n, 8); i > 0; i--)
+			v = (v << 8) | p[i - 1];
+	}
+
+	return v;
+} /* loadword() */
+
+
 static const char *tooctal(char buf[3], unsigned char chr) {
 	if (chr > 0x1f && chr < 0x7f) {
 		buf[0] = chr;
@@ -252,6 +351,10 @@ static inline int getint(const unsigned char **fmt) {
 #define F_SPACE 8
 #define F_PLUS 16
 
+/* word size in bytes, packed above the flags operand of OP_CONV */
+#define F_WORD(n) ((0xff & (n)) << 8)
+#define F_WORDSIZE(flags) (0xff & ((flags) >> 8))
+
 #define FC2(x, y) (((0xff & (y)) << 8) | (0xff & (x)))
 #define FC1(x) (0xff & (x))
 #define FC(...) XPASTE(FC, NARG(__VA_ARGS__))(__VA_ARGS__)
@@ -297,6 +400,9 @@ width:
 	case 'd': case 'i': case 'o': case 'u': case 'X': case 'x':
 		*bytes = 4;
 		break;
+	case 'e': case 'E': case 'f': case 'g': case 'G':
+		*bytes = 8;
+		break;
 	case 's':
 		if (*prec == -1)
 			return 0;
@@ -336,9 +442,6 @@ width:
 			}
 			*bytes = 0;
 
-			/* XXX: Not supported yet. */
-			return 0;
-
 			break;
 		case 'c':
 			ch = FC('_', 'c');
@@ -415,6 +518,31 @@ enum vm_opcode {
 
 #define OK_8XADDR(F, W, P) OK_IS0FIXED((F), (W), (P), 8)
 	OP_8XADDR,
+
+	/*
+	 * Fixed-width, fixed-byte-order word loads. 0/1 like READ, but the
+	 * width and byte order are resolved at compile time.
+	 */
+	OP_LE16,
+	OP_BE16,
+	OP_LE32,
+	OP_BE32,
+	OP_LE64,
+	OP_BE64,
+
+	/*
+	 * Byte-class colouring for HXD_COLOR. COLOR switches the terminal
+	 * colour to that of the class of the next input octet, unless it's
+	 * already current; NOCOLOR restores the default colour.
+	 */
+	OP_COLOR,   /* 0/0 */
+	OP_NOCOLOR, /* 0/0 */
+
+	/*
+	 * Single-octet %c and %_p for HXD_JSON, escaped for a JSON string.
+	 */
+	OP_JCBYTE,
+	OP_JPBYTE,
 }; /* enum vm_opcode */
 
 
@@ -453,6 +581,16 @@ static const char *vm_strop(enum vm_opcode op) {
 		[OP_PBYTE]  = "PBYTE",
 		[OP_7XADDR] = "7XADDR",
 		[OP_8XADDR] = "8XADDR",
+		[OP_LE16]   = "LE16",
+		[OP_BE16]   = "BE16",
+		[OP_LE32]   = "LE32",
+		[OP_BE32]   = "BE32",
+		[OP_LE64]   = "LE64",
+		[OP_BE64]   = "BE64",
+		[OP_COLOR]  = "COLOR",
+		[OP_NOCOLOR] = "NOCOLOR",
+		[OP_JCBYTE] = "JCBYTE",
+		[OP_JPBYTE] = "JPBYTE",
 	};
 
 	if ((int)op >= 0 && op < (int)countof(txt) && txt[op])
@@ -462,18 +600,43 @@ static const char *vm_strop(enum vm_opcode op) {
 } /* vm_strop() */
 
 
+/*
+ * Build with -DVM_PROFILE to count executions of each instruction and, on
+ * x86 with GCC-compatible compilers, the TSC cycles until the next one is
+ * dispatched. Costs of OP_CONV and friends include the formatting.
+ */
+#ifndef VM_PROFILE
+#define VM_PROFILE 0
+#endif
+
+#ifndef VM_PROFILE_TSC
+#if VM_PROFILE && __GNUC__ && (__x86_64__ || __i386__)
+#define VM_PROFILE_TSC 1
+#else
+#define VM_PROFILE_TSC 0
+#endif
+#endif
+
+#if VM_PROFILE_TSC
+#include <x86intrin.h> /* __rdtsc() */
+#endif
+
 struct vm_state {
 	jmp_buf trap;
 
 	int flags;
 
 	size_t blocksize;
+	size_t outsize; /* upper bound of output per block, or of the epilogue */
 
 	int64_t stack[8];
 	int sp;
 
 	unsigned char code[4096];
 	int pc;
+	int epilogue; /* entry point of %_A unit run once at end of input */
+
+	int color; /* class of the current HXD_COLOR colour, or 0 */
 
 	struct {
 		unsigned char *base, *p, *pe;
@@ -483,7 +646,26 @@ struct vm_state {
 
 	struct {
 		unsigned char *base, *p, *pe;
+		_Bool borrowed; /* base is the caller's, from hxd_setout() */
 	} o;
+
+	struct {
+		char *base;
+		size_t size;
+	} x; /* scratch for conversions too long for vm_conv()'s buffer */
+
+	struct hxd_stats stats;
+
+#if VM_PROFILE
+	struct {
+		struct {
+			unsigned long long count, cycles;
+		} pc[4096]; /* indexed like code */
+
+		unsigned long long tsc;
+		int last; /* pc being timed, or -1 */
+	} prof;
+#endif
 }; /* struct vm_state */
 
 
@@ -557,6 +739,18 @@ NOTUSED static void vm_dump(struct vm_state *M, FILE *fp) {
 	int pc = 0;
 
 	fprintf(fp, "-- blocksize: %zu\n", M->blocksize);
+	fprintf(fp, "-- outsize: %zu\n", M->outsize);
+
+	do {
+		op = M->code[pc];
+		op_dump(M, &pc, fp);
+	} while (op != OP_HALT);
+
+	if (!M->epilogue)
+		return /* void */;
+
+	fprintf(fp, "-- epilogue\n");
+	pc = M->epilogue;
 
 	do {
 		op = M->code[pc];
@@ -565,6 +759,85 @@ NOTUSED static void vm_dump(struct vm_state *M, FILE *fp) {
 } /* vm_dump() */
 
 
+#if VM_PROFILE
+static void prof_list(struct vm_state *M, int pc, FILE *fp) {
+	enum vm_opcode op;
+
+	do {
+		op = M->code[pc];
+
+#if VM_PROFILE_TSC
+		fprintf(fp, "%12llu %14llu %9.1f  ", M->prof.pc[pc].count, M->prof.pc[pc].cycles,
+			(M->prof.pc[pc].count)? (double)M->prof.pc[pc].cycles / M->prof.pc[pc].count : 0.0);
+#else
+		fprintf(fp, "%12llu  ", M->prof.pc[pc].count);
+#endif
+		op_dump(M, &pc, fp);
+	} while (op != OP_HALT);
+} /* prof_list() */
+
+
+/*
+ * Print the compiled machine annotated with execution counts (and cycles
+ * when available), followed by totals for each opcode.
+ */
+NOTUSED static void vm_profile(struct vm_state *M, FILE *fp) {
+	unsigned long long count[256] = { 0 }, cycles[256] = { 0 }, total = 0;
+	int pc, op;
+
+#if VM_PROFILE_TSC
+	fprintf(fp, "%12s %14s %9s  %s\n", "count", "cycles", "cyc/op", "instruction");
+#else
+	fprintf(fp, "%12s  %s\n", "count", "instruction");
+#endif
+	prof_list(M, 0, fp);
+
+	if (M->epilogue) {
+		fprintf(fp, "-- epilogue\n");
+		prof_list(M, M->epilogue, fp);
+	}
+
+	for (pc = 0; pc < (int)countof(M->prof.pc); pc++) {
+		count[M->code[pc]] += M->prof.pc[pc].count;
+		cycles[M->code[pc]] += M->prof.pc[pc].cycles;
+		total += M->prof.pc[pc].cycles;
+	}
+
+	fprintf(fp, "-- totals\n");
+
+	for (op = 0; op < (int)countof(count); op++) {
+		if (!count[op])
+			continue;
+#if VM_PROFILE_TSC
+		fprintf(fp, "%12llu %14llu %9.1f  %-8s %5.1f%%\n", count[op], cycles[op],
+			(double)cycles[op] / count[op], vm_strop(op),
+			(total)? 100.0 * cycles[op] / total : 0.0);
+#else
+		fprintf(fp, "%12llu  %s\n", count[op], vm_strop(op));
+#endif
+	}
+} /* vm_profile() */
+
+
+static inline void vm_prof(struct vm_state *M) {
+#if VM_PROFILE_TSC
+	unsigned long long tsc = __rdtsc();
+
+	if (M->prof.last >= 0)
+		M->prof.pc[M->prof.last].cycles += tsc - M->prof.tsc;
+
+	M->prof.tsc = tsc;
+#endif
+	M->prof.pc[M->pc].count++;
+	M->prof.last = M->pc;
+} /* vm_prof() */
+
+#define VM_PROF(M) vm_prof((M))
+#else
+#define VM_PROF(M) (void)0
+#endif
+
+
 #ifdef _WIN32
 #define vm_enter(M) setjmp((M)->trap)
 #else
@@ -585,37 +858,133 @@ static inline unsigned char vm_getc(struct vm_state *M) {
 } /* vm_getc() */
 
 
-static void vm_putc(struct vm_state *M, unsigned char ch) {
+static void vm_reserve(struct vm_state *M, size_t n) {
 	unsigned char *tmp;
 	size_t size, p;
 
-	if (!(M->o.p < M->o.pe)) {
-		size = MAX(M->o.pe - M->o.base, 64);
-		p = M->o.p - M->o.base;
+	if ((size_t)(M->o.pe - M->o.p) >= n)
+		return /* void */;
+
+	if (M->o.borrowed)
+		vm_throw(M, ENOBUFS);
 
+	size = MAX(M->o.pe - M->o.base, 64);
+	p = M->o.p - M->o.base;
+
+	do {
 		if (~size < size)
 			vm_throw(M, ENOMEM);
 
 		size *= 2;
+	} while (size - p < n);
 
-		if (!(tmp = realloc(M->o.base, size)))
-			vm_throw(M, errno);
+	if (!(tmp = realloc(M->o.base, size)))
+		vm_throw(M, errno);
 
-		M->o.base = tmp;
-		M->o.p = &tmp[p];
-		M->o.pe = &tmp[size];
-	}
+	M->o.base = tmp;
+	M->o.p = &tmp[p];
+	M->o.pe = &tmp[size];
+
+	M->stats.reallocs++;
+	M->stats.peak = MAX(M->stats.peak, size);
+} /* vm_reserve() */
+
+
+static void vm_putc(struct vm_state *M, unsigned char ch) {
+	if (!(M->o.p < M->o.pe))
+		vm_reserve(M, 1);
 
 	*M->o.p++ = ch;
 } /* vm_putc() */
 
 
+static inline uint64_t vm_getword(struct vm_state *M, size_t n, _Bool big) {
+	uint64_t v;
+
+	n = MIN(n, (size_t)(M->i.pe - M->i.p));
+
+	if (!n)
+		return 0;
+
+	v = loadword(M->i.p, n, big);
+	M->i.p += n;
+
+	return v;
+} /* vm_getword() */
+
+
+static void vm_puts(struct vm_state *M, const char *src) {
+	while (*src)
+		vm_putc(M, *src++);
+} /* vm_puts() */
+
+
+/*
+ * Octet classes coloured by HXD_COLOR, and the SGR sequence selecting
+ * each class's colour; class 0 restores the default.
+ */
+#define CL_NUL 1
+#define CL_PRINT 2
+#define CL_SPACE 3
+#define CL_CNTRL 4
+#define CL_HIGH 5
+
+#define CL_X4(c) c, c, c, c
+#define CL_X16(c) CL_X4(c), CL_X4(c), CL_X4(c), CL_X4(c)
+
+static const unsigned char vm_class[256] = {
+	/* 0x00 */ CL_NUL, CL_CNTRL, CL_CNTRL, CL_CNTRL, CL_X4(CL_CNTRL),
+	           CL_CNTRL, CL_SPACE, CL_SPACE, CL_SPACE, CL_SPACE, CL_SPACE, CL_CNTRL, CL_CNTRL,
+	/* 0x10 */ CL_X16(CL_CNTRL),
+	/* 0x20 */ CL_SPACE, CL_PRINT, CL_PRINT, CL_PRINT, CL_X4(CL_PRINT), CL_X4(CL_PRINT), CL_X4(CL_PRINT),
+	/* 0x30 */ CL_X16(CL_PRINT), CL_X16(CL_PRINT), CL_X16(CL_PRINT),
+	/* 0x60 */ CL_X16(CL_PRINT),
+	/* 0x70 */ CL_X4(CL_PRINT), CL_X4(CL_PRINT), CL_X4(CL_PRINT), CL_PRINT, CL_PRINT, CL_PRINT, CL_CNTRL,
+	/* 0x80 */ CL_X16(CL_HIGH), CL_X16(CL_HIGH), CL_X16(CL_HIGH), CL_X16(CL_HIGH),
+	/* 0xc0 */ CL_X16(CL_HIGH), CL_X16(CL_HIGH), CL_X16(CL_HIGH), CL_X16(CL_HIGH),
+}; /* vm_class[] */
+
+static const char *const vm_sgr[] = {
+	[0]        = "\033[0m",
+	[CL_NUL]   = "\033[90m", /* bright black */
+	[CL_PRINT] = "\033[36m", /* cyan */
+	[CL_SPACE] = "\033[32m", /* green */
+	[CL_CNTRL] = "\033[35m", /* magenta */
+	[CL_HIGH]  = "\033[33m", /* yellow */
+}; /* vm_sgr[] */
+
+#define CL_MAXSGR 5 /* longest of vm_sgr[] */
+
+
 static void vm_putx(struct vm_state *M, unsigned char ch) {
 	vm_putc(M, "0123456789abcdef"[0x0f & (ch >> 4)]);
 	vm_putc(M, "0123456789abcdef"[0x0f & (ch >> 0)]);
 } /* vm_putx() */
 
 
+/*
+ * Write an octet as it must appear inside a JSON string, for HXD_JSON.
+ * Octets above 0x7e are escaped as the code point of the same value, as
+ * if the input were ISO 8859-1, so the output is always valid UTF-8.
+ */
+#define JS_MAXESC 6 /* longest escape, \u00XX */
+
+static void vm_putj(struct vm_state *M, unsigned char ch) {
+	if (ch == '"' || ch == '\\') {
+		vm_putc(M, '\\');
+		vm_putc(M, ch);
+	} else if (ch > 0x1f && ch < 0x7f) {
+		vm_putc(M, ch);
+	} else if (ch >= '\b' && ch <= '\r' && ch != '\v') {
+		vm_putc(M, '\\');
+		vm_putc(M, "btn-fr"[ch - '\b']);
+	} else {
+		vm_puts(M, "\\u00");
+		vm_putx(M, ch);
+	}
+} /* vm_putj() */
+
+
 static inline size_t vm_address(struct vm_state *M) {
 	return M->i.address + (M->i.p - M->i.base);
 } /* vm_address() */
@@ -636,152 +1005,672 @@ NOTUSED static int64_t vm_peek(struct vm_state *M, int i) {
 } /* vm_peek() */
 
 
-static void vm_conv(struct vm_state *M, int flags, int width, int prec, int fc, int64_t word) {
-	char fmt[32], *fp, buf[256], label[3];
-	const char *s = NULL;
-	int i, len;
+/*
+ * Floating point conversions. Digits are generated with the counted mode
+ * of Grisu (Florian Loitsch, "Printing Floating-Point Numbers Quickly and
+ * Accurately with Integers", PLDI 2010): the value is scaled by a cached
+ * power of ten into a 64-bit fixed-point number from which the requested
+ * count of digits is cut. The result is correctly rounded whenever the
+ * error of the scaling provably doesn't matter, which is nearly always.
+ * Otherwise, and for digit counts beyond what 64 bits can deliver, the
+ * caller falls back to snprintf(3).
+ */
+struct diyfp {
+	uint64_t f;
+	int e;
+}; /* struct diyfp */
+
+static const struct {
+	uint64_t f;
+	short e, k;
+} fp_powers[] = { /* 10^k ~= f * 2^e, for k = -348, -340, ..., 340 */
+	{ UINT64_C(0xfa8fd5a0081c0288), -1220, -348 },
+	{ UINT64_C(0xbaaee17fa23ebf76), -1193, -340 },
+	{ UINT64_C(0x8b16fb203055ac76), -1166, -332 },
+	{ UINT64_C(0xcf42894a5dce35ea), -1140, -324 },
+	{ UINT64_C(0x9a6bb0aa55653b2d), -1113, -316 },
+	{ UINT64_C(0xe61acf033d1a45df), -1087, -308 },
+	{ UINT64_C(0xab70fe17c79ac6ca), -1060, -300 },
+	{ UINT64_C(0xff77b1fcbebcdc4f), -1034, -292 },
+	{ UINT64_C(0xbe5691ef416bd60c), -1007, -284 },
+	{ UINT64_C(0x8dd01fad907ffc3c),  -980, -276 },
+	{ UINT64_C(0xd3515c2831559a83),  -954, -268 },
+	{ UINT64_C(0x9d71ac8fada6c9b5),  -927, -260 },
+	{ UINT64_C(0xea9c227723ee8bcb),  -901, -252 },
+	{ UINT64_C(0xaecc49914078536d),  -874, -244 },
+	{ UINT64_C(0x823c12795db6ce57),  -847, -236 },
+	{ UINT64_C(0xc21094364dfb5637),  -821, -228 },
+	{ UINT64_C(0x9096ea6f3848984f),  -794, -220 },
+	{ UINT64_C(0xd77485cb25823ac7),  -768, -212 },
+	{ UINT64_C(0xa086cfcd97bf97f4),  -741, -204 },
+	{ UINT64_C(0xef340a98172aace5),  -715, -196 },
+	{ UINT64_C(0xb23867fb2a35b28e),  -688, -188 },
+	{ UINT64_C(0x84c8d4dfd2c63f3b),  -661, -180 },
+	{ UINT64_C(0xc5dd44271ad3cdba),  -635, -172 },
+	{ UINT64_C(0x936b9fcebb25c996),  -608, -164 },
+	{ UINT64_C(0xdbac6c247d62a584),  -582, -156 },
+	{ UINT64_C(0xa3ab66580d5fdaf6),  -555, -148 },
+	{ UINT64_C(0xf3e2f893dec3f126),  -529, -140 },
+	{ UINT64_C(0xb5b5ada8aaff80b8),  -502, -132 },
+	{ UINT64_C(0x87625f056c7c4a8b),  -475, -124 },
+	{ UINT64_C(0xc9bcff6034c13053),  -449, -116 },
+	{ UINT64_C(0x964e858c91ba2655),  -422, -108 },
+	{ UINT64_C(0xdff9772470297ebd),  -396, -100 },
+	{ UINT64_C(0xa6dfbd9fb8e5b88f),  -369,  -92 },
+	{ UINT64_C(0xf8a95fcf88747d94),  -343,  -84 },
+	{ UINT64_C(0xb94470938fa89bcf),  -316,  -76 },
+	{ UINT64_C(0x8a08f0f8bf0f156b),  -289,  -68 },
+	{ UINT64_C(0xcdb02555653131b6),  -263,  -60 },
+	{ UINT64_C(0x993fe2c6d07b7fac),  -236,  -52 },
+	{ UINT64_C(0xe45c10c42a2b3b06),  -210,  -44 },
+	{ UINT64_C(0xaa242499697392d3),  -183,  -36 },
+	{ UINT64_C(0xfd87b5f28300ca0e),  -157,  -28 },
+	{ UINT64_C(0xbce5086492111aeb),  -130,  -20 },
+	{ UINT64_C(0x8cbccc096f5088cc),  -103,  -12 },
+	{ UINT64_C(0xd1b71758e219652c),   -77,   -4 },
+	{ UINT64_C(0x9c40000000000000),   -50,    4 },
+	{ UINT64_C(0xe8d4a51000000000),   -24,   12 },
+	{ UINT64_C(0xad78ebc5ac620000),     3,   20 },
+	{ UINT64_C(0x813f3978f8940984),    30,   28 },
+	{ UINT64_C(0xc097ce7bc90715b3),    56,   36 },
+	{ UINT64_C(0x8f7e32ce7bea5c70),    83,   44 },
+	{ UINT64_C(0xd5d238a4abe98068),   109,   52 },
+	{ UINT64_C(0x9f4f2726179a2245),   136,   60 },
+	{ UINT64_C(0xed63a231d4c4fb27),   162,   68 },
+	{ UINT64_C(0xb0de65388cc8ada8),   189,   76 },
+	{ UINT64_C(0x83c7088e1aab65db),   216,   84 },
+	{ UINT64_C(0xc45d1df942711d9a),   242,   92 },
+	{ UINT64_C(0x924d692ca61be758),   269,  100 },
+	{ UINT64_C(0xda01ee641a708dea),   295,  108 },
+	{ UINT64_C(0xa26da3999aef774a),   322,  116 },
+	{ UINT64_C(0xf209787bb47d6b85),   348,  124 },
+	{ UINT64_C(0xb454e4a179dd1877),   375,  132 },
+	{ UINT64_C(0x865b86925b9bc5c2),   402,  140 },
+	{ UINT64_C(0xc83553c5c8965d3d),   428,  148 },
+	{ UINT64_C(0x952ab45cfa97a0b3),   455,  156 },
+	{ UINT64_C(0xde469fbd99a05fe3),   481,  164 },
+	{ UINT64_C(0xa59bc234db398c25),   508,  172 },
+	{ UINT64_C(0xf6c69a72a3989f5c),   534,  180 },
+	{ UINT64_C(0xb7dcbf5354e9bece),   561,  188 },
+	{ UINT64_C(0x88fcf317f22241e2),   588,  196 },
+	{ UINT64_C(0xcc20ce9bd35c78a5),   614,  204 },
+	{ UINT64_C(0x98165af37b2153df),   641,  212 },
+	{ UINT64_C(0xe2a0b5dc971f303a),   667,  220 },
+	{ UINT64_C(0xa8d9d1535ce3b396),   694,  228 },
+	{ UINT64_C(0xfb9b7cd9a4a7443c),   720,  236 },
+	{ UINT64_C(0xbb764c4ca7a44410),   747,  244 },
+	{ UINT64_C(0x8bab8eefb6409c1a),   774,  252 },
+	{ UINT64_C(0xd01fef10a657842c),   800,  260 },
+	{ UINT64_C(0x9b10a4e5e9913129),   827,  268 },
+	{ UINT64_C(0xe7109bfba19c0c9d),   853,  276 },
+	{ UINT64_C(0xac2820d9623bf429),   880,  284 },
+	{ UINT64_C(0x80444b5e7aa7cf85),   907,  292 },
+	{ UINT64_C(0xbf21e44003acdd2d),   933,  300 },
+	{ UINT64_C(0x8e679c2f5e44ff8f),   960,  308 },
+	{ UINT64_C(0xd433179d9c8cb841),   986,  316 },
+	{ UINT64_C(0x9e19db92b4e31ba9),  1013,  324 },
+	{ UINT64_C(0xeb96bf6ebadf77d9),  1039,  332 },
+	{ UINT64_C(0xaf87023b9bf0ee6b),  1066,  340 },
+}; /* fp_powers[] */
+
+#define FP_MINEXP -60 /* binary exponent range of the scaled value */
+#define FP_MAXEXP -32
+#define FP_MAXDIGITS 17
+
+static struct diyfp fp_multiply(struct diyfp x, struct diyfp y) {
+	uint64_t a = x.f >> 32, b = x.f & 0xffffffff;
+	uint64_t c = y.f >> 32, d = y.f & 0xffffffff;
+	uint64_t ac = a * c, bc = b * c, ad = a * d, bd = b * d;
+	uint64_t tmp = (bd >> 32) + (ad & 0xffffffff) + (bc & 0xffffffff) + (UINT64_C(1) << 31);
+	struct diyfp r;
+
+	r.f = ac + (ad >> 32) + (bc >> 32) + (tmp >> 32);
+	r.e = x.e + y.e + 64;
+
+	return r;
+} /* fp_multiply() */
+
+
+/*
+ * Round the digits in buf given the remainder rest, in units where
+ * ten_kappa is one unit of the last digit, and which is off by at most
+ * unit. Returns 0 if the direction can't be decided, 1 on success, and 2
+ * if rounding carried out of the first digit.
+ */
+static int fp_round(char *buf, int count, uint64_t rest, uint64_t ten_kappa, uint64_t unit) {
+	int i;
 
-	switch (fc) {
-	case FC('_', 'c'):
-		s = tooctal(label, word);
-		prec = (prec > 0)? MIN(prec, 3) : 3;
-		fc = 's';
+	if (unit >= ten_kappa || ten_kappa - unit <= unit)
+		return 0;
 
-		break;
-	case FC('_', 'p'):
-		word = toprint(word);
-		fc = 'c';
+	if ((ten_kappa - rest > rest) && (ten_kappa - 2 * rest >= 2 * unit))
+		return 1;
 
-		break;
-	case FC('_', 'u'):
-		s = toshort(label, word);
-		prec = (prec > 0)? MIN(prec, 3) : 3;
-		fc = 's';
+	if ((rest > unit) && (ten_kappa - (rest - unit) <= (rest - unit))) {
+		buf[count - 1]++;
 
-		break;
-	case FC('_', 'd'):
-		word = M->i.address + (M->i.p - M->i.base);
-		fc = 'd';
+		for (i = count - 1; i > 0 && buf[i] == '0' + 10; i--) {
+			buf[i] = '0';
+			buf[i - 1]++;
+		}
 
-		break;
-	case FC('_', 'o'):
-		word = M->i.address + (M->i.p - M->i.base);
-		fc = 'o';
+		if (buf[0] == '0' + 10) {
+			buf[0] = '1';
 
-		break;
-	case FC('_', 'x'):
-		word = M->i.address + (M->i.p - M->i.base);
-		fc = 'x';
+			return 2;
+		}
 
-		break;
-	case FC('_', 'D'):
-		/* FALL THROUGH */
-	case FC('_', 'O'):
-		/* FALL THROUGH */
-	case FC('_', 'X'):
-		fc = 'x';
+		return 1;
+	}
 
-		vm_throw(M, HXD_ENOTSUPP);
+	return 0;
+} /* fp_round() */
 
-		break;
-	case FC('s'):
-		s = (const char *)M->i.p;
 
-		if (prec <= 0 || prec > M->i.pe - M->i.p)
-			prec = M->i.pe - M->i.p;
+/*
+ * Generate exactly count significant digits of the positive, finite,
+ * non-zero v into buf and the decimal exponent of the first digit into
+ * exp. Returns 0 on failure, 1 on success, and 2 if rounding carried
+ * into a new leading digit.
+ */
+static int fp_digits(char *buf, int count, double v, int *exp) {
+	static const uint32_t pow10[] = {
+		1, 10, 100, 1000, 10000, 100000, 1000000, 10000000,
+		100000000, 1000000000,
+	};
+	struct diyfp w, c;
+	uint64_t bits, one, rest, error = 1;
+	uint32_t integrals, divisor;
+	int i, kappa, length = 0, rv;
 
-		break;
-	case FC('c'):
-		/* FALL THROUGH */
-	case FC('d'): case FC('i'): case FC('o'):
-	case FC('u'): case FC('X'): case FC('x'):
-		break;
-	default:
-		vm_throw(M, HXD_ENOTSUPP);
+	memcpy(&bits, &v, sizeof bits);
 
-		break;
-	} /* switch() */
+	if ((bits >> 52) & 0x7ff) {
+		w.f = (bits & ((UINT64_C(1) << 52) - 1)) | (UINT64_C(1) << 52);
+		w.e = (int)((bits >> 52) & 0x7ff) - 1075;
+	} else {
+		w.f = bits & ((UINT64_C(1) << 52) - 1);
+		w.e = -1074;
+	}
 
-	fp = fmt;
+	while (!(w.f & (UINT64_C(1) << 63))) {
+		w.f <<= 1;
+		w.e--;
+	}
 
-	*fp++ = '%';
+	/* guess the cached power scaling w into range, then adjust */
+	i = ((int)((FP_MINEXP - w.e - 1) * 0.30102999566398114) + 348) / 8;
+	i = MAX(0, MIN(i, (int)countof(fp_powers) - 1));
 
-	if (flags & F_HASH)
-		*fp++ = '#';
-	if (flags & F_ZERO)
-		*fp++ = '0';
-	if (flags & F_MINUS)
-		*fp++ = '-';
-	if (flags & F_PLUS)
-		*fp++ = '+';
+	while (i < (int)countof(fp_powers) - 1 && w.e + fp_powers[i].e + 64 < FP_MINEXP)
+		i++;
+	while (i > 0 && w.e + fp_powers[i].e + 64 > FP_MAXEXP)
+		i--;
 
-	*fp++ = '*';
-	*fp++ = '.';
-	*fp++ = '*';
-	*fp++ = fc;
-	*fp = '\0';
+	c.f = fp_powers[i].f;
+	c.e = fp_powers[i].e;
+	w = fp_multiply(w, c);
 
-	switch (fc) {
-	case 's':
-		len = snprintf(buf, sizeof buf, fmt, MAX(width, 0), MAX(prec, 0), s);
+	one = UINT64_C(1) << -w.e;
+	integrals = (uint32_t)(w.f >> -w.e);
+	rest = w.f & (one - 1);
 
-		break;
-	case 'u':
-		len = snprintf(buf, sizeof buf, fmt, MAX(width, 0), prec, (unsigned)word);
+	for (kappa = 1; kappa < (int)countof(pow10) && integrals >= pow10[kappa]; kappa++)
+		;;
 
-		break;
-	default:
-		len = snprintf(buf, sizeof buf, fmt, MAX(width, 0), prec, (int)word);
+	divisor = pow10[kappa - 1];
 
-		break;
+	while (kappa > 0) {
+		buf[length++] = '0' + integrals / divisor;
+		integrals %= divisor;
+		kappa--;
+
+		if (!--count) {
+			rest += (uint64_t)integrals << -w.e;
+
+			if (!(rv = fp_round(buf, length, rest, (uint64_t)divisor << -w.e, error)))
+				return 0;
+
+			goto done;
+		}
+
+		divisor /= 10;
 	}
 
-	if (-1 == len)
-		vm_throw(M, errno);
+	while (count > 0 && rest > error) {
+		rest *= 10;
+		error *= 10;
+		buf[length++] = '0' + (int)(rest >> -w.e);
+		rest &= one - 1;
+		kappa--;
+		count--;
+	}
 
-	if (len >= (int)sizeof buf)
-		vm_throw(M, ENOMEM);
+	if (count || !(rv = fp_round(buf, length, rest, one, error)))
+		return 0;
+done:
+	*exp = length + kappa - fp_powers[i].k - 1 + (rv == 2);
 
-	for (i = 0; i < len; i++)
-		vm_putc(M, buf[i]);
-} /* vm_conv() */
+	return rv;
+} /* fp_digits() */
 
 
-#ifndef VM_FASTER
-#ifdef __GNUC__
-#define VM_FASTER 1
-#else
-#define VM_FASTER 0
-#endif
-#endif
+/*
+ * Format v like snprintf(3) with the %e, %E, %f, %g, or %G conversions.
+ * Returns the length of the output, or -1 if the caller should fall back
+ * to snprintf(3).
+ */
+static int fmtfloat(char *dst, size_t lim, int flags, int width, int prec, int fc, double v) {
+	char digits[FP_MAXDIGITS], body[64], *p;
+	int count = 0, exp = 0, est, b, rv, i, len, pad;
+	uint64_t bits;
+	_Bool sci = 0, trim = 0;
+	char sign = 0;
+
+	memcpy(&bits, &v, sizeof bits);
+
+	if (((bits >> 52) & 0x7ff) == 0x7ff)
+		return -1; /* leave the spelling of inf and nan to libc */
+
+	if (bits >> 63) {
+		v = -v;
+		sign = '-';
+	} else if (flags & F_PLUS) {
+		sign = '+';
+	} else if (flags & F_SPACE) {
+		sign = ' ';
+	}
 
-#if VM_FASTER
-#define GNUX(...) (__extension__ ({ __VA_ARGS__; })) /* quiet compiler diagnostics */
-#define BEGIN GNUX(goto *jump[M->code[M->pc]])
-#define END (void)0
-#define CASE(op) XPASTE(OP_, op)
-#define NEXT GNUX(goto *jump[M->code[++M->pc]])
-#else
-#define BEGIN exec: switch (M->code[M->pc]) {
-#define END } (void)0
-#define CASE(op) case XPASTE(OP_, op)
-#define NEXT ++M->pc; goto exec
-#endif
+	prec = (prec < 0)? 6 : prec;
 
-static void vm_exec(struct vm_state *M) {
-#if VM_FASTER
-#define L(L) (__extension__ &&XPASTE(OP_, L))
-	static const void *const jump[] = {
-		L(HALT), L(NOOP), L(TRAP), L(PC), L(TRUE), L(FALSE),
-		L(ZERO), L(ONE), L(TWO), L(I8), L(I16), L(I32),
-		L(NEG), L(SUB), L(ADD), L(NOT), L(OR), L(LT),
+	if (prec > 32)
+		return -1;
+
+	if (fc == 'f') {
+		if (v != 0) {
+			/* floor(log10(v)) is est or est + 1 */
+			if (!(b = (int)((bits >> 52) & 0x7ff)))
+				return -1;
+
+			b -= 1023;
+			est = (b >= 0)? (b * 78913) >> 18 : -((-b * 78913 + 262143) >> 18);
+
+			for (i = 0; i < 3; i++) {
+				count = est + 1 + prec;
+
+				if (count < 1 || count > FP_MAXDIGITS)
+					return -1;
+
+				if (!(rv = fp_digits(digits, count, v, &exp)))
+					return -1;
+
+				if (exp - (rv == 2) == est)
+					break;
+
+				est = exp - (rv == 2);
+			}
+
+			if (i == 3)
+				return -1;
+		}
+	} else {
+		if (fc == 'g' || fc == 'G') {
+			prec = (prec)? prec : 1;
+			count = prec;
+			trim = !(flags & F_HASH);
+		} else {
+			count = prec + 1;
+		}
+
+		if (count > FP_MAXDIGITS)
+			return -1;
+
+		if (v != 0 && !(rv = fp_digits(digits, count, v, &exp)))
+			return -1;
+
+		/* libc picks the %#g style from the unrounded exponent */
+		if (v != 0 && rv == 2 && (flags & F_HASH) && (fc == 'g' || fc == 'G'))
+			return -1;
+
+		if (fc == 'g' || fc == 'G') {
+			if (prec > exp && exp >= -4) {
+				prec = prec - 1 - exp;
+			} else {
+				prec = prec - 1;
+				sci = 1;
+			}
+		} else {
+			sci = 1;
+		}
+	}
+
+	if (v == 0)
+		count = 0;
+
+#define DIGIT(i) (((i) >= 0 && (i) < count)? digits[(i)] : '0')
+	p = body;
+
+	if (sci) {
+		*p++ = DIGIT(0);
+
+		if (prec > 0 || (flags & F_HASH))
+			*p++ = '.';
+
+		for (i = 1; i <= prec; i++)
+			*p++ = DIGIT(i);
+	} else {
+		if (exp < 0)
+			*p++ = '0';
+
+		for (i = 0; i <= exp; i++)
+			*p++ = DIGIT(i);
+
+		if (prec > 0 || (flags & F_HASH))
+			*p++ = '.';
+
+		for (i = 1; i <= prec; i++)
+			*p++ = DIGIT(exp + i);
+	}
+#undef DIGIT
+
+	if (trim && memchr(body, '.', p - body)) {
+		while (p[-1] == '0')
+			--p;
+
+		if (p[-1] == '.')
+			--p;
+	}
+
+	if (sci) {
+		*p++ = (fc == 'E' || fc == 'G')? 'E' : 'e';
+		*p++ = (exp < 0)? '-' : '+';
+		exp = (exp < 0)? -exp : exp;
+
+		if (exp >= 100)
+			*p++ = '0' + exp / 100;
+
+		*p++ = '0' + (exp / 10) % 10;
+		*p++ = '0' + exp % 10;
+	}
+
+	len = (p - body) + !!sign;
+	pad = MAX(width - len, 0);
+
+	if ((size_t)(len + pad) >= lim)
+		return -1;
+
+	p = dst;
+
+	if (!(flags & (F_MINUS|F_ZERO)))
+		for (i = 0; i < pad; i++)
+			*p++ = ' ';
+
+	if (sign)
+		*p++ = sign;
+
+	if ((flags & F_ZERO) && !(flags & F_MINUS))
+		for (i = 0; i < pad; i++)
+			*p++ = '0';
+
+	memcpy(p, body, len - !!sign);
+	p += len - !!sign;
+
+	if (flags & F_MINUS)
+		for (i = 0; i < pad; i++)
+			*p++ = ' ';
+
+	*p = '\0';
+
+	return p - dst;
+} /* fmtfloat() */
+
+
+/* printf(3) format taking width and precision arguments, e.g. "%0*.*x" */
+static void convfmt(char fmt[32], int flags, int fc) {
+	char *fp = fmt;
+
+	*fp++ = '%';
+
+	if (flags & F_HASH)
+		*fp++ = '#';
+	if (flags & F_ZERO)
+		*fp++ = '0';
+	if (flags & F_MINUS)
+		*fp++ = '-';
+	if (flags & F_PLUS)
+		*fp++ = '+';
+	if (flags & F_SPACE)
+		*fp++ = ' ';
+
+	*fp++ = '*';
+	*fp++ = '.';
+	*fp++ = '*';
+
+	if (F_WORDSIZE(flags) > 4 && strchr("diouXx", fc)) {
+		*fp++ = 'l';
+		*fp++ = 'l';
+	}
+
+	*fp++ = fc;
+	*fp = '\0';
+} /* convfmt() */
+
+
+/* grow the scratch buffer for conversions longer than vm_conv()'s own */
+static void vm_scratch(struct vm_state *M, size_t n) {
+	char *tmp;
+
+	if (M->x.size >= n)
+		return /* void */;
+
+	if (!(tmp = realloc(M->x.base, n)))
+		vm_throw(M, errno);
+
+	M->x.base = tmp;
+	M->x.size = n;
+} /* vm_scratch() */
+
+
+/* conversions rendering octets as text, which HXD_JSON escapes */
+static _Bool istext(int fc) {
+	switch (fc) {
+	case FC('c'): case FC('s'):
+	case FC('_', 'c'): case FC('_', 'p'): case FC('_', 'u'):
+		return 1;
+	default:
+		return 0;
+	}
+} /* istext() */
+
+
+static void vm_conv(struct vm_state *M, int flags, int width, int prec, int fc, int64_t word) {
+	char fmt[32], buf[256], label[3], *dst = buf;
+	const char *s = NULL;
+	_Bool json = (M->flags & HXD_JSON) && istext(fc);
+	size_t lim = sizeof buf;
+	int i, len;
+
+	switch (fc) {
+	case FC('_', 'c'):
+		s = tooctal(label, word);
+		prec = (prec > 0)? MIN(prec, 3) : 3;
+		fc = 's';
+
+		break;
+	case FC('_', 'p'):
+		word = toprint(word);
+		fc = 'c';
+
+		break;
+	case FC('_', 'u'):
+		s = toshort(label, word);
+		prec = (prec > 0)? MIN(prec, 3) : 3;
+		fc = 's';
+
+		break;
+	case FC('_', 'd'):
+		word = M->i.address + (M->i.p - M->i.base);
+		fc = 'd';
+
+		break;
+	case FC('_', 'o'):
+		word = M->i.address + (M->i.p - M->i.base);
+		fc = 'o';
+
+		break;
+	case FC('_', 'x'):
+		word = M->i.address + (M->i.p - M->i.base);
+		fc = 'x';
+
+		break;
+	case FC('_', 'D'):
+		/* FALL THROUGH */
+	case FC('_', 'O'):
+		/* FALL THROUGH */
+	case FC('_', 'X'):
+		fc = 'x';
+
+		vm_throw(M, HXD_ENOTSUPP);
+
+		break;
+	case FC('s'):
+		s = (const char *)M->i.p;
+
+		if (prec <= 0 || prec > M->i.pe - M->i.p)
+			prec = M->i.pe - M->i.p;
+
+		break;
+	case FC('c'):
+		/* FALL THROUGH */
+	case FC('d'): case FC('i'): case FC('o'):
+	case FC('u'): case FC('X'): case FC('x'):
+		/* FALL THROUGH */
+	case FC('e'): case FC('E'): case FC('f'):
+	case FC('g'): case FC('G'):
+		break;
+	default:
+		vm_throw(M, HXD_ENOTSUPP);
+
+		break;
+	} /* switch() */
+
+	convfmt(fmt, flags, fc);
+
+	/* long %f, widths and precisions are redone in the scratch buffer */
+	for (;;) {
+		switch (fc) {
+		case 's':
+			len = snprintf(dst, lim, fmt, MAX(width, 0), MAX(prec, 0), s);
+
+			break;
+		case 'u':
+			if (F_WORDSIZE(flags) > 4)
+				len = snprintf(dst, lim, fmt, MAX(width, 0), prec, (unsigned long long)word);
+			else
+				len = snprintf(dst, lim, fmt, MAX(width, 0), prec, (unsigned)word);
+
+			break;
+		case 'd': case 'i':
+			if (F_WORDSIZE(flags) > 4)
+				len = snprintf(dst, lim, fmt, MAX(width, 0), prec, (long long)word);
+			else
+				len = snprintf(dst, lim, fmt, MAX(width, 0), prec, (int)word);
+
+			break;
+		case 'o': case 'X': case 'x':
+			if (F_WORDSIZE(flags) > 4)
+				len = snprintf(dst, lim, fmt, MAX(width, 0), prec, (unsigned long long)word);
+			else
+				len = snprintf(dst, lim, fmt, MAX(width, 0), prec, (int)word);
+
+			break;
+		case 'e': case 'E': case 'f': case 'g': case 'G': {
+			double d;
+
+			if (F_WORDSIZE(flags) == 4) {
+				uint32_t u32 = word;
+				float f;
+
+				memcpy(&f, &u32, sizeof f);
+				d = f;
+			} else {
+				uint64_t u64 = word;
+
+				memcpy(&d, &u64, sizeof d);
+			}
+
+			if (-1 == (len = fmtfloat(dst, lim, flags, MAX(width, 0), prec, fc, d)))
+				len = snprintf(dst, lim, fmt, MAX(width, 0), prec, d);
+
+			break;
+		}
+		default:
+			len = snprintf(dst, lim, fmt, MAX(width, 0), prec, (int)word);
+
+			break;
+		}
+
+		if (-1 == len)
+			vm_throw(M, errno);
+
+		if ((size_t)len < lim)
+			break;
+
+		vm_scratch(M, (size_t)len + 1);
+		dst = M->x.base;
+		lim = M->x.size;
+	}
+
+	for (i = 0; i < len; i++) {
+		if (json)
+			vm_putj(M, dst[i]);
+		else
+			vm_putc(M, dst[i]);
+	}
+} /* vm_conv() */
+
+
+#ifndef VM_FASTER
+#ifdef __GNUC__
+#define VM_FASTER 1
+#else
+#define VM_FASTER 0
+#endif
+#endif
+
+#if VM_FASTER
+#define GNUX(...) (__extension__ ({ __VA_ARGS__; })) /* quiet compiler diagnostics */
+#define BEGIN GNUX(VM_PROF(M); goto *jump[M->code[M->pc]])
+#define END (void)0
+#define CASE(op) XPASTE(OP_, op)
+#define NEXT GNUX(++M->pc; VM_PROF(M); goto *jump[M->code[M->pc]])
+#else
+#define BEGIN exec: VM_PROF(M); switch (M->code[M->pc]) {
+#define END } (void)0
+#define CASE(op) case XPASTE(OP_, op)
+#define NEXT ++M->pc; goto exec
+#endif
+
+static void vm_exec(struct vm_state *M) {
+#if VM_FASTER
+#define L(L) (__extension__ &&XPASTE(OP_, L))
+	static const void *const jump[] = {
+		L(HALT), L(NOOP), L(TRAP), L(PC), L(TRUE), L(FALSE),
+		L(ZERO), L(ONE), L(TWO), L(I8), L(I16), L(I32),
+		L(NEG), L(SUB), L(ADD), L(NOT), L(OR), L(LT),
 		L(POP), L(DUP), L(SWAP), L(READ), L(COUNT), L(PUTC), L(CONV),
 		L(CHOP), L(PAD), L(JMP), L(RESET),
 		L(2XBYTE), L(PBYTE), L(7XADDR), L(8XADDR),
+		L(LE16), L(BE16), L(LE32), L(BE32), L(LE64), L(BE64),
+		L(COLOR), L(NOCOLOR), L(JCBYTE), L(JPBYTE),
 	};
 #endif
 	int64_t v;
 
+#if VM_PROFILE
+	M->prof.last = -1;
+#endif
+
 	BEGIN;
 
 	CASE(HALT):
@@ -837,14 +1726,14 @@ static void vm_exec(struct vm_state *M) {
 
 		NEXT;
 	CASE(NEG):
-		vm_push(M, -vm_pop(M));
+		vm_push(M, -(uint64_t)vm_pop(M));
 
 		NEXT;
 	CASE(SUB): {
 		int64_t b = vm_pop(M);
 		int64_t a = vm_pop(M);
 
-		vm_push(M, a - b);
+		vm_push(M, (uint64_t)a - b);
 
 		NEXT;
 	}
@@ -852,7 +1741,7 @@ static void vm_exec(struct vm_state *M) {
 		int64_t b = vm_pop(M);
 		int64_t a = vm_pop(M);
 
-		vm_push(M, a + b);
+		vm_push(M, (uint64_t)a + b);
 
 		NEXT;
 	}
@@ -898,21 +1787,11 @@ static void vm_exec(struct vm_state *M) {
 		NEXT;
 	}
 	CASE(READ): {
-		int64_t i, n, v;
+		int64_t n;
+		uint64_t v;
 
 		n = vm_pop(M);
-		v = 0;
-
-		if (M->flags & HXD_BIG_ENDIAN) {
-			for (i = 0; i < n && M->i.p < M->i.pe; i++) {
-				v <<= 8;
-				v |= *M->i.p++;
-			}
-		} else {
-			for (i = 0; i < n && M->i.p < M->i.pe; i++) {
-				v |= *M->i.p++ << (8 * i);
-			}
-		}
+		v = (n > 0)? vm_getword(M, n, !!(M->flags & HXD_BIG_ENDIAN)) : 0;
 
 		vm_push(M, v);
 
@@ -960,7 +1839,7 @@ static void vm_exec(struct vm_state *M) {
 		if (vm_pop(M)) {
 			M->pc = pc % countof(M->code);
 #if VM_FASTER
-			GNUX(goto *jump[M->code[pc]]);
+			GNUX(VM_PROF(M); goto *jump[M->code[M->pc]]);
 #else
 			goto exec;
 #endif
@@ -998,6 +1877,52 @@ static void vm_exec(struct vm_state *M) {
 
 		NEXT;
 	}
+	CASE(LE16):
+		vm_push(M, vm_getword(M, 2, 0));
+
+		NEXT;
+	CASE(BE16):
+		vm_push(M, vm_getword(M, 2, 1));
+
+		NEXT;
+	CASE(LE32):
+		vm_push(M, vm_getword(M, 4, 0));
+
+		NEXT;
+	CASE(BE32):
+		vm_push(M, vm_getword(M, 4, 1));
+
+		NEXT;
+	CASE(LE64):
+		vm_push(M, vm_getword(M, 8, 0));
+
+		NEXT;
+	CASE(BE64):
+		vm_push(M, vm_getword(M, 8, 1));
+
+		NEXT;
+	CASE(COLOR):
+		if (M->i.p < M->i.pe && vm_class[*M->i.p] != M->color) {
+			M->color = vm_class[*M->i.p];
+			vm_puts(M, vm_sgr[M->color]);
+		}
+
+		NEXT;
+	CASE(NOCOLOR):
+		if (M->color) {
+			M->color = 0;
+			vm_puts(M, vm_sgr[0]);
+		}
+
+		NEXT;
+	CASE(JCBYTE):
+		vm_putj(M, vm_getc(M));
+
+		NEXT;
+	CASE(JPBYTE):
+		vm_putj(M, toprint(vm_getc(M)));
+
+		NEXT;
 	END;
 } /* vm_exec() */
 
@@ -1099,35 +2024,175 @@ static void emit_link(struct vm_state *M, int from, int to) {
 } /* emit_link() */
 
 
-static void emit_unit(struct vm_state *M, int loop, int limit, int flags, size_t *blocksize, const unsigned char **fmt) {
-	_Bool quoted = 0, escaped = 0;
-	int consumes = 0, chop = 0;
-	int L1, L2, C1 = 0, from, ch;
+static void emit_read(struct vm_state *M, int bytes) {
+	_Bool big = !!(M->flags & HXD_BIG_ENDIAN);
 
-	loop = (loop < 0)? 1 : loop;
+	switch (bytes) {
+	case 2:
+		emit_op(M, (big)? OP_BE16 : OP_LE16);
 
-	/* loop counter */
-	emit_int(M, 0);
+		break;
+	case 4:
+		emit_op(M, (big)? OP_BE32 : OP_LE32);
 
-	/* top of loop */
-	L1 = M->pc;
-	emit_op(M, OP_DUP); /* dup counter */
-	emit_int(M, loop);  /* push loop count */
-	emit_op(M, OP_SWAP);
-	emit_op(M, OP_SUB); /* loop - counter */
-	emit_op(M, OP_NOT);
-	if (flags & HXD_NOPADDING) {
-		emit_op(M, OP_COUNT);
-		C1 = M->pc; /* patch destination for unit size */
-		emit_op(M, OP_TRAP);
-		emit_op(M, OP_TRAP);
-		emit_op(M, OP_LT);
-		emit_op(M, OP_OR);
+		break;
+	case 8:
+		emit_op(M, (big)? OP_BE64 : OP_LE64);
+
+		break;
+	default:
+		emit_int(M, bytes);
+		emit_op(M, OP_READ);
+
+		break;
 	}
-	emit_jmp(M, &L2);
+} /* emit_read() */
 
-	emit_int(M, 1);
-	emit_op(M, OP_ADD);
+
+/*
+ * Intermediate representation of a format. parse_format() builds it
+ * before any code is generated, so units can be analyzed in the context
+ * of their line and of the whole format, e.g. to extend the trailing unit
+ * of a short line or to run a %_A unit once at the end. Every line, unit,
+ * and item consumes at least one character of the format, so the arrays
+ * are sized once from its length.
+ */
+struct ir_item {
+	int fc; /* conversion, or 0 for a literal */
+	int flags, width, prec, bytes;
+	unsigned char chr;
+}; /* struct ir_item */
+
+struct ir_unit {
+	int loop, limit, flags;
+	int consumes; /* octets converted per iteration */
+	int pad;      /* octets skipped per iteration to fill the byte count */
+	_Bool setrep; /* explicit iteration count */
+	_Bool isend;  /* contains %_A */
+	size_t item, nitem;
+}; /* struct ir_unit */
+
+struct ir_line {
+	size_t unit, nunit;
+	size_t blocksize;
+}; /* struct ir_line */
+
+struct ir {
+	struct ir_item *item;
+	struct ir_unit *unit;
+	struct ir_line *line;
+	size_t nitem, nunit, nline;
+
+	struct ir_unit *end; /* last unit with %_A, compiled as the epilogue */
+
+	size_t blocksize;
+	size_t outsize; /* upper bound of output per block, or of the epilogue */
+}; /* struct ir */
+
+
+static void ir_close(struct ir *ir) {
+	if (!ir)
+		return /* void */;
+
+	free(ir->item);
+	free(ir->unit);
+	free(ir->line);
+	free(ir);
+} /* ir_close() */
+
+
+static struct ir *ir_open(size_t len) {
+	struct ir *ir;
+
+	if (!(ir = calloc(1, sizeof *ir)))
+		return NULL;
+
+	ir->item = calloc(len, sizeof *ir->item);
+	ir->unit = calloc(len, sizeof *ir->unit);
+	ir->line = calloc(len, sizeof *ir->line);
+
+	if (!ir->item || !ir->unit || !ir->line) {
+		ir_close(ir);
+
+		return NULL;
+	}
+
+	return ir;
+} /* ir_open() */
+
+
+static inline int unit_size(const struct ir_unit *U) {
+	return U->consumes + U->pad;
+} /* unit_size() */
+
+
+/*
+ * Upper bound of the output of one conversion, or of the width spaces a
+ * short block pads with instead.
+ */
+static size_t item_outsize(const struct ir_item *I) {
+	int prec = MAX(I->prec, 0);
+	size_t n;
+
+	switch (I->fc) {
+	case 0:
+		return 1;
+	case FC('c'): case FC('_', 'p'):
+		n = 1;
+		break;
+	case FC('_', 'c'): case FC('_', 'u'):
+		n = 3;
+		break;
+	case FC('s'):
+		n = MAX(I->bytes, 0);
+		break;
+	case FC('d'): case FC('i'): case FC('u'):
+		/* digits of 2^(8 * bytes), and a sign */
+		n = MAX((I->bytes * 241 + 99) / 100, prec) + 1;
+		break;
+	case FC('o'):
+		n = MAX((I->bytes * 8 + 2) / 3, prec) + 1;
+		break;
+	case FC('x'): case FC('X'):
+		n = MAX(I->bytes * 2, prec) + 2;
+		break;
+	case FC('_', 'd'):
+		n = MAX(20, prec);
+		break;
+	case FC('_', 'o'):
+		n = MAX(22, prec) + 1;
+		break;
+	case FC('_', 'x'):
+		n = MAX(16, prec) + 2;
+		break;
+	case FC('e'): case FC('E'): case FC('g'): case FC('G'):
+		/* sign, digit, point, and a 3-digit exponent */
+		n = ((I->prec < 0)? 6 : prec) + 8;
+		break;
+	case FC('f'):
+		/* sign, the integral digits of FLT_MAX or DBL_MAX, and point */
+		n = ((I->prec < 0)? 6 : prec) + ((I->bytes == 4)? 39 : 309) + 2;
+		break;
+	default:
+		n = 255;
+		break;
+	}
+
+	return MAX(n, (size_t)MAX(I->width, 0));
+} /* item_outsize() */
+
+
+static void parse_unit(struct vm_state *M, struct ir *ir, int loop, int limit, int flags, const unsigned char **fmt) {
+	struct ir_unit *U = &ir->unit[ir->nunit++];
+	struct ir_item *I;
+	_Bool quoted = 0, escaped = 0;
+	int ch;
+
+	U->setrep = (loop >= 0);
+	U->loop = (loop < 0)? 1 : loop;
+	U->limit = limit;
+	U->flags = flags;
+	U->item = ir->nitem;
 
 	while ((ch = **fmt)) {
 		switch (ch) {
@@ -1150,56 +2215,62 @@ static void emit_unit(struct vm_state *M, int loop, int limit, int flags, size_t
 			}
 
 			if (limit >= 0 && bytes > 0) {
-				bytes = MIN(limit - consumes, bytes);
+				switch (fc) {
+				case 'd': case 'i': case 'o':
+				case 'u': case 'X': case 'x':
+					/* an explicit byte count sets the word size */
+					bytes = limit - U->consumes;
+
+					/* words are loaded into 64 bits */
+					if (bytes > 8)
+						vm_throw(M, HXD_EFORMAT);
+
+					break;
+				default:
+					bytes = MIN(limit - U->consumes, bytes);
+
+					break;
+				}
 
 				if (!bytes) /* FIXME: define better error */
 					vm_throw(M, HXD_EDRAINED);
 			}
 
-			consumes += bytes;
-
-			{
-				int J1, J2;
+			switch (fc) {
+			case 'e': case 'E': case 'f': case 'g': case 'G':
+				/* only float and double are supported */
+				if (bytes != 4 && bytes != 8)
+					vm_throw(M, HXD_EFORMAT);
 
-				if (bytes > 0) {
-					if (width > 0) {
-						emit_op(M, OP_COUNT);
-						emit_jmp(M, &J1);
-						emit_int(M, width);
-						emit_op(M, OP_PAD);
-						emit_op(M, OP_TRUE);
-						emit_jmp(M, &J2);
-						emit_link(M, J1, M->pc);
-					} else {
-						emit_op(M, OP_COUNT);
-						emit_op(M, OP_NOT);
-						emit_jmp(M, &J2);
-					}
-				}
+				break;
+			case FC('_', 'D'): case FC('_', 'O'): case FC('_', 'X'):
+				U->isend = 1;
 
-				if (fc == 'x' && OK_2XBYTE(flags, width, prec)) {
-					emit_op(M, OP_2XBYTE);
-				} else if (fc == FC('_', 'p') && OK_PBYTE(flags, width, prec)) {
-					emit_op(M, OP_PBYTE);
-				} else if (fc == FC('_', 'x') && OK_7XADDR(flags, width, prec)) {
-					emit_op(M, OP_7XADDR);
-				} else if (fc == FC('_', 'x') && OK_8XADDR(flags, width, prec)) {
-					emit_op(M, OP_8XADDR);
-				} else {
-					emit_int(M, (fc == 's')? 0 : bytes);
-					emit_op(M, OP_READ);
-					emit_int(M, flags);
-					emit_int(M, width);
-					emit_int(M, prec);
-					emit_int(M, fc);
-					emit_op(M, OP_CONV);
-				}
+				break;
+			case 'c': case 's':
+			case 'd': case 'i': case 'o': case 'u': case 'X': case 'x':
+			case FC('_', 'd'): case FC('_', 'o'): case FC('_', 'x'):
+			case FC('_', 'c'): case FC('_', 'p'): case FC('_', 'u'):
+				break;
+			default:
+				/* neither vm_conv() nor gen_conv() knows it */
+				vm_throw(M, HXD_ENOTSUPP);
 
-				if (bytes > 0)
-					emit_link(M, J2, M->pc);
+				break;
 			}
 
-			chop = 0;
+			/* escaped text has no fixed width to pad to */
+			if ((U->flags & HXD_JSON) && istext(fc))
+				width = 0;
+
+			U->consumes += bytes;
+
+			I = &ir->item[ir->nitem++];
+			I->fc = fc;
+			I->flags = flags;
+			I->width = width;
+			I->prec = prec;
+			I->bytes = bytes;
 
 			break;
 		}
@@ -1264,36 +2335,240 @@ static void emit_unit(struct vm_state *M, int loop, int limit, int flags, size_t
 			goto copyout;
 		default:
 copyout:
-			emit_putc(M, ch);
+			I = &ir->item[ir->nitem++];
+			I->chr = ch;
 
 			escaped = 0;
+		}
+
+		++*fmt;
+	}
+
+epilog:
+	if (U->loop > 0 && U->consumes < limit)
+		U->pad = limit - U->consumes;
+
+	U->nitem = ir->nitem - U->item;
+} /* parse_unit() */
+
+
+static void parse_format(struct vm_state *M, struct ir *ir, const unsigned char *fmt) {
+	struct ir_line *L;
+	struct ir_unit *U;
+	size_t endsize = 0, i;
+
+	while (skipws(&fmt, 1)) {
+		int lc, loop, limit, flags;
+
+		flags = M->flags;
+
+		L = &ir->line[ir->nline++];
+		L->unit = ir->nunit;
+
+		do {
+			loop = getint(&fmt);
 
-			if (hxd_isspace(ch, 0)) {
-				chop++;
+			if ('/' == skipws(&fmt, 0)) {
+				fmt++;
+				limit = getint(&fmt);
+	
+				if (*fmt == '?') {
+					flags |= HXD_NOPADDING;
+					fmt++;
+				}
 			} else {
-				chop = 0;
+				limit = -1;
 			}
+
+			skipws(&fmt, 0);
+			parse_unit(M, ir, loop, limit, flags, &fmt);
+
+			U = &ir->unit[ir->nunit - 1];
+
+			if (U->isend)
+				ir->end = U;
+			else
+				L->blocksize += (size_t)(unit_size(U) * U->loop);
+		} while ((lc = skipws(&fmt, 0)) && lc != '\n');
+
+		L->nunit = ir->nunit - L->unit;
+		ir->blocksize = MAX(ir->blocksize, L->blocksize);
+	}
+
+	/*
+	 * As in BSD hexdump(1), when a line converts fewer octets than the
+	 * block, its last converting unit, if it has no iteration count,
+	 * repeats to consume the remainder.
+	 */
+	for (L = ir->line; L < &ir->line[ir->nline]; L++) {
+		if (L->blocksize >= ir->blocksize)
+			continue;
+
+		for (U = &ir->unit[L->unit + L->nunit]; U > &ir->unit[L->unit]; ) {
+			--U;
+
+			if (!U->isend && unit_size(U))
+				break;
 		}
 
-		++*fmt;
+		if (L->nunit && !U->isend && !U->setrep && unit_size(U) > 0)
+			U->loop += (ir->blocksize - L->blocksize) / unit_size(U);
 	}
 
-epilog:
-	if (loop > 0 && consumes < limit) {
-		emit_int(M, limit - consumes);
-		emit_op(M, OP_READ);
-		emit_op(M, OP_POP);
+	for (U = ir->unit; U < &ir->unit[ir->nunit]; U++) {
+		size_t size = 0;
+
+		for (i = U->item; i < U->item + U->nitem; i++) {
+			if ((M->flags & HXD_JSON) && istext(ir->item[i].fc))
+				size += item_outsize(&ir->item[i]) * JS_MAXESC;
+			else
+				size += item_outsize(&ir->item[i]);
+		}
 
-		consumes = limit;
+		/* every item may change the colour */
+		if (M->flags & HXD_COLOR)
+			size += U->nitem * CL_MAXSGR;
+
+		if (U->isend)
+			endsize = size;
+		else
+			ir->outsize += size * U->loop;
 	}
 
-	if (flags & HXD_NOPADDING) {
-		if (consumes > 255)
-			vm_throw(M, ERANGE);
+	if (M->flags & HXD_COLOR) {
+		ir->outsize += CL_MAXSGR;
+		endsize += CL_MAXSGR;
+	}
+
+	/* hxd_flush() runs the epilogue alone, so one bound covers both */
+	ir->outsize = MAX(ir->outsize, endsize);
+} /* parse_format() */
+
+
+/*
+ * Map conversions of an epilogue unit to the address conversion printing
+ * the final address, or 0 if the conversion prints nothing.
+ */
+static int endcnv(int fc) {
+	switch (fc) {
+	case FC('_', 'D'): case FC('_', 'd'):
+		return FC('_', 'd');
+	case FC('_', 'O'): case FC('_', 'o'):
+		return FC('_', 'o');
+	case FC('_', 'X'): case FC('_', 'x'):
+		return FC('_', 'x');
+	default:
+		return 0;
+	}
+} /* endcnv() */
+
+
+/* single-octet conversions, which HXD_COLOR colours by octet class */
+static _Bool emit_iscolored(int fc, int bytes) {
+	switch (fc) {
+	case 'c': case 'd': case 'i': case 'o': case 'u': case 'x': case 'X':
+	case FC('_', 'c'): case FC('_', 'p'): case FC('_', 'u'):
+		return bytes == 1;
+	default:
+		return 0;
+	}
+} /* emit_iscolored() */
+
+
+static void emit_unit(struct vm_state *M, const struct ir *ir, const struct ir_unit *U, _Bool epilogue) {
+	const struct ir_item *I;
+	int loop = (epilogue)? 1 : U->loop;
+	int chop = 0;
+	int L1, L2, from;
+
+	/* loop counter */
+	emit_int(M, 0);
+
+	/* top of loop */
+	L1 = M->pc;
+	emit_op(M, OP_DUP); /* dup counter */
+	emit_int(M, loop);  /* push loop count */
+	emit_op(M, OP_SWAP);
+	emit_op(M, OP_SUB); /* loop - counter */
+	emit_op(M, OP_NOT);
+	if (!epilogue && (U->flags & HXD_NOPADDING)) {
+		emit_op(M, OP_COUNT);
+		emit_int(M, unit_size(U));
+		emit_op(M, OP_LT);
+		emit_op(M, OP_OR);
+	}
+	emit_jmp(M, &L2);
+
+	emit_int(M, 1);
+	emit_op(M, OP_ADD);
+
+	for (I = &ir->item[U->item]; I < &ir->item[U->item + U->nitem]; I++) {
+		int fc = I->fc, flags = I->flags, width = I->width, prec = I->prec, bytes = I->bytes;
+		int J1, J2;
+
+		if (!fc) {
+			if ((M->flags & HXD_COLOR) && !hxd_isspace(I->chr, 0))
+				emit_op(M, OP_NOCOLOR);
+
+			emit_putc(M, I->chr);
+
+			chop = (hxd_isspace(I->chr, 0))? chop + 1 : 0;
+
+			continue;
+		}
+
+		chop = 0;
+
+		if (epilogue && !(fc = endcnv(fc)))
+			continue; /* data conversions print nothing */
+
+		/* padding only aligns columns, so HXD_JSON leaves it out */
+		if (bytes > 0) {
+			if (width > 0 && !(M->flags & HXD_JSON)) {
+				emit_op(M, OP_COUNT);
+				emit_jmp(M, &J1);
+				emit_int(M, width);
+				emit_op(M, OP_PAD);
+				emit_op(M, OP_TRUE);
+				emit_jmp(M, &J2);
+				emit_link(M, J1, M->pc);
+			} else {
+				emit_op(M, OP_COUNT);
+				emit_op(M, OP_NOT);
+				emit_jmp(M, &J2);
+			}
+		}
+
+		if (M->flags & HXD_COLOR)
+			emit_op(M, (emit_iscolored(fc, bytes))? OP_COLOR : OP_NOCOLOR);
+
+		if (fc == 'x' && bytes == 1 && OK_2XBYTE(flags, width, prec)) {
+			emit_op(M, OP_2XBYTE);
+		} else if (fc == FC('_', 'p') && OK_PBYTE(flags, width, prec)) {
+			emit_op(M, (M->flags & HXD_JSON)? OP_JPBYTE : OP_PBYTE);
+		} else if (fc == FC('c') && bytes == 1 && OK_PBYTE(flags, width, prec) && (M->flags & HXD_JSON)) {
+			emit_op(M, OP_JCBYTE);
+		} else if (fc == FC('_', 'x') && OK_7XADDR(flags, width, prec)) {
+			emit_op(M, OP_7XADDR);
+		} else if (fc == FC('_', 'x') && OK_8XADDR(flags, width, prec)) {
+			emit_op(M, OP_8XADDR);
+		} else {
+			emit_read(M, (fc == 's')? 0 : bytes);
+			emit_int(M, flags | F_WORD(bytes));
+			emit_int(M, width);
+			emit_int(M, prec);
+			emit_int(M, fc);
+			emit_op(M, OP_CONV);
+		}
+
+		if (bytes > 0)
+			emit_link(M, J2, M->pc);
+	}
 
-		/* patch in our unit size */
-		M->code[C1 + 0] = OP_I8;
-		M->code[C1 + 1] = consumes;
+	if (!epilogue && U->pad > 0) {
+		emit_int(M, U->pad);
+		emit_op(M, OP_READ);
+		emit_op(M, OP_POP);
 	}
 
 	emit_op(M, OP_TRUE);
@@ -1307,16 +2582,62 @@ epilog:
 		emit_int(M, chop);
 		emit_op(M, OP_CHOP);
 	}
+} /* emit_unit() */
 
-	*blocksize += (size_t)(consumes * loop);
 
-	return /* void */;
-} /* emit_unit() */
+static void emit_format(struct vm_state *M, const struct ir *ir) {
+	const struct ir_line *L;
+	const struct ir_unit *U;
+
+	for (L = ir->line; L < &ir->line[ir->nline]; L++) {
+		emit_op(M, OP_RESET);
+
+		for (U = &ir->unit[L->unit]; U < &ir->unit[L->unit + L->nunit]; U++) {
+			if (!U->isend)
+				emit_unit(M, ir, U, 0);
+		}
+	}
+
+	if (M->flags & HXD_COLOR)
+		emit_op(M, OP_NOCOLOR);
+
+	emit_op(M, OP_HALT);
+
+	if (ir->end) {
+		M->epilogue = M->pc;
+		emit_unit(M, ir, ir->end, 1);
+
+		if (M->flags & HXD_COLOR)
+			emit_op(M, OP_NOCOLOR);
+
+		emit_op(M, OP_HALT);
+	}
+
+	memset(&M->code[M->pc], OP_TRAP, sizeof M->code - M->pc);
+} /* emit_format() */
 
 
 struct hexdump {
 	struct vm_state vm;
 
+	size_t retain; /* output buffer size kept once drained; 0 is no limit */
+
+	_Bool ended; /* epilogue already run */
+
+	unsigned char *stage; /* input buffer while formatting caller memory */
+
+	struct ir *ir; /* format kept for HXD_REVERSE */
+
+	struct {
+		unsigned char *base, *p, *pe;
+	} own; /* output buffer set aside by hxd_setout() */
+
+	struct {
+		unsigned char *base, *p, *pe, *lim; /* unparsed text is [p, pe) */
+		uint64_t address; /* of the next block */
+		_Bool started, repeat;
+	} rev;
+
 	char help[64];
 }; /* struct hexdump */
 
@@ -1346,7 +2667,10 @@ syerr:
 
 static void hxd_destroy(struct hexdump *X) {
 	free(X->vm.i.base);
-	free(X->vm.o.base);
+	free((X->vm.o.borrowed)? X->own.base : X->vm.o.base);
+	free(X->vm.x.base);
+	ir_close(X->ir);
+	free(X->rev.base);
 } /* hxd_destroy() */
 
 
@@ -1359,703 +2683,4012 @@ void hxd_close(struct hexdump *X) {
 } /* hxd_close() */
 
 
+static void hxd_shrink(struct hexdump *, size_t);
+
 void hxd_reset(struct hexdump *X) {
 	X->vm.i.address = 0;
 	X->vm.i.p = X->vm.i.base;
 	X->vm.o.p = X->vm.o.base;
 	X->vm.pc = 0;
-} /* hxd_reset() */
+	X->vm.color = 0;
+	X->ended = 0;
 
+	X->rev.p = X->rev.base;
+	X->rev.pe = X->rev.base;
+	X->rev.address = 0;
+	X->rev.started = 0;
+	X->rev.repeat = 0;
 
-int hxd_compile(struct hexdump *X, const char *_fmt, int flags) {
-	const unsigned char *fmt;
-	unsigned char *tmp;
-	int error;
+	if (X->retain)
+		hxd_shrink(X, X->retain);
+} /* hxd_reset() */
 
-	hxd_reset(X);
 
-	if ((error = vm_enter(&X->vm)))
-		goto error;
+/*
+ * Reverse mode. With HXD_REVERSE the IR is kept and interpreted against
+ * formatted text, rebuilding each block from its integer conversions.
+ * Literal whitespace matches loosely, because looping units chop their
+ * trailing whitespace and padding widens fields, and a field or literal
+ * missing from a short block ends the block there. %_p and %c cannot be
+ * decoded and are skipped. A "*" line, which BSD hexdump(1) prints for
+ * repeated blocks, repeats the last block up to the next address.
+ */
+struct rev_cursor {
+	const unsigned char *p, *pe;
+	_Bool eof, starved; /* starved if more text could change the parse */
+}; /* struct rev_cursor */
 
-	X->vm.flags = flags;
 
-	if (!HXD_BYTEORDER(X->vm.flags)) {
-		union { int i; char c; } u = { 0 };
+/* digit values plus one, or 0 */
+static const unsigned char rev_digit[256] = {
+	['0'] = 1, ['1'] = 2, ['2'] = 3, ['3'] = 4, ['4'] = 5,
+	['5'] = 6, ['6'] = 7, ['7'] = 8, ['8'] = 9, ['9'] = 10,
+	['a'] = 11, ['b'] = 12, ['c'] = 13, ['d'] = 14, ['e'] = 15, ['f'] = 16,
+	['A'] = 11, ['B'] = 12, ['C'] = 13, ['D'] = 14, ['E'] = 15, ['F'] = 16,
+}; /* rev_digit[] */
 
-		u.c = 1;
-		X->vm.flags |= (u.i & 0xff)? HXD_LITTLE_ENDIAN : HXD_BIG_ENDIAN;
-	}
 
-	fmt = (const unsigned char *)_fmt;
+static inline int rev_base(int fc) {
+	switch (fc) {
+	case 'x': case 'X': case FC('_', 'x'):
+		return 16;
+	case 'o': case FC('_', 'o'):
+		return 8;
+	case 'd': case 'i': case 'u': case FC('_', 'd'):
+		return 10;
+	default:
+		return 0;
+	}
+} /* rev_base() */
 
-	while (skipws(&fmt, 1)) {
-		int lc, loop, limit, flags;
-		size_t blocksize = 0;
 
-		flags = X->vm.flags;
+static inline _Bool rev_isaddr(int fc) {
+	return fc == FC('_', 'd') || fc == FC('_', 'o') || fc == FC('_', 'x');
+} /* rev_isaddr() */
 
-		emit_op(&X->vm, OP_RESET);
 
-		do {
-			loop = getint(&fmt);
+static void rev_check(struct vm_state *M, const struct ir *ir) {
+	const struct ir_unit *U;
+	const struct ir_item *I;
+	_Bool decodes = 0;
 
-			if ('/' == skipws(&fmt, 0)) {
-				fmt++;
-				limit = getint(&fmt);
-	
-				if (*fmt == '?') {
-					flags |= HXD_NOPADDING;
-					fmt++;
-				}
-			} else {
-				limit = -1;
-			}
+	for (U = ir->unit; U < &ir->unit[ir->nunit]; U++) {
+		if (U->isend)
+			continue;
 
-			skipws(&fmt, 0);
-			emit_unit(&X->vm, loop, limit, flags, &blocksize, &fmt);
-		} while ((lc = skipws(&fmt, 0)) && lc != '\n');
+		for (I = &ir->item[U->item]; I < &ir->item[U->item + U->nitem]; I++) {
+			if (!I->fc || rev_isaddr(I->fc) || I->fc == 'c' || I->fc == FC('_', 'p'))
+				continue;
+			else if (!rev_base(I->fc))
+				vm_throw(M, HXD_ENOTSUPP);
 
-		if (blocksize > X->vm.blocksize)
-			X->vm.blocksize = blocksize;
+			decodes = 1;
+		}
 	}
 
-	emit_op(&X->vm, OP_HALT);
-	memset(&X->vm.code[X->vm.pc], OP_TRAP, sizeof X->vm.code - X->vm.pc);
+	if (!decodes)
+		vm_throw(M, HXD_ENOTSUPP);
+} /* rev_check() */
 
-	if (!(tmp = realloc(X->vm.i.base, X->vm.blocksize)))
-		goto syerr;
 
-	X->vm.i.base = tmp;
-	X->vm.i.p = tmp;
-	X->vm.i.pe = &tmp[X->vm.blocksize];
+static inline int rev_peek(struct rev_cursor *C) {
+	if (C->p < C->pe)
+		return *C->p;
 
-	return 0;
-syerr:
-	error = errno;
-error:
-	hxd_reset(X);
-	memset(X->vm.code, 0, sizeof X->vm.code);
+	if (!C->eof)
+		C->starved = 1;
 
-	return error;
-} /* hxd_compile() */
+	return -1;
+} /* rev_peek() */
 
 
-size_t hxd_blocksize(struct hexdump *X) {
-	return X->vm.blocksize;
-} /* hxd_blocksize() */
+/*
+ * Characters printed by a data conversion whose width covers its widest
+ * value, so fields needn't be separated; otherwise 0, for no limit.
+ */
+static size_t rev_width(const struct ir_item *I) {
+	int digits;
 
+	switch (rev_base(I->fc)) {
+	case 16:
+		digits = I->bytes * 2;
+		break;
+	case 8:
+		digits = (I->bytes * 8 + 2) / 3;
+		break;
+	default:
+		digits = (I->bytes * 241 + 99) / 100 + (I->fc != 'u');
+		break;
+	}
 
-const char *hxd_help(struct hexdump *X) {
-	(void)X;
-	return "helps";
-} /* hxd_help() */
+	return (!(I->flags & F_HASH) && I->width >= digits)? (size_t)I->width : 0;
+} /* rev_width() */
 
 
-int hxd_write(struct hexdump *X, const void *src, size_t len) {
-	const unsigned char *p, *pe;
-	size_t n;
-	int error;
+/* skip at most lim spaces and tabs */
+static inline void rev_skipws(struct rev_cursor *C, size_t lim) {
+	int ch;
 
-	if ((error = vm_enter(&X->vm)))
-		goto error;
+	while (lim-- && ((ch = rev_peek(C)) == ' ' || ch == '\t'))
+		C->p++;
+} /* rev_skipws() */
 
-	if (X->vm.i.pe == X->vm.i.base)
-		vm_throw(&X->vm, HXD_EOOPS);
 
-	p = src;
-	pe = p + len;
+/*
+ * Parse an optionally signed number from at most lim characters, or any
+ * number if lim is 0. False if there are no digits.
+ */
+static _Bool rev_number(struct rev_cursor *C, int base, _Bool sign, size_t lim, uint64_t *v) {
+	const unsigned char *pe = C->pe;
+	_Bool eof = C->eof, neg = 0, any = 0;
+	unsigned d;
+	int ch;
 
-	while (p < pe) {
-		n = MIN(pe - p, X->vm.i.pe - X->vm.i.p);
-		memcpy(X->vm.i.p, p, n);
-		X->vm.i.p += n;
-		p += n;
+	if (lim && lim < (size_t)(C->pe - C->p)) {
+		C->pe = C->p + lim;
+		C->eof = 1;
+	}
 
-		if (X->vm.i.p < X->vm.i.pe)
-			break;
+	rev_skipws(C, (size_t)-1);
 
-		X->vm.i.p = X->vm.i.base;
-		X->vm.pc = 0;
-		vm_exec(&X->vm);
-		X->vm.i.p = X->vm.i.base;
-		X->vm.i.address += X->vm.blocksize;
+	if (sign && ((ch = rev_peek(C)) == '-' || ch == '+')) {
+		neg = (ch == '-');
+		C->p++;
 	}
 
-	return 0;
-error:
-	return error;
-} /* hxd_write() */
+	/* %#x prefix */
+	if (base == 16 && rev_peek(C) == '0') {
+		if (C->p + 1 == C->pe && !C->eof)
+			C->starved = 1;
+		else if (C->p + 1 < C->pe && (C->p[1] | 0x20) == 'x')
+			C->p += 2;
+	}
 
+	for (*v = 0; (ch = rev_peek(C)) >= 0 && (d = rev_digit[ch]) && --d < (unsigned)base; C->p++) {
+		*v = *v * base + d;
+		any = 1;
+	}
 
-int hxd_flush(struct hexdump *X) {
-	unsigned char *pe;
-	int error;
+	if (neg)
+		*v = -*v;
 
-	if ((error = vm_enter(&X->vm)))
-		goto error;
+	C->pe = pe;
+	C->eof = eof;
 
-	if (X->vm.i.p > X->vm.i.base) {
-		pe = X->vm.i.pe;
-		X->vm.i.pe = X->vm.i.p;
-		X->vm.i.p = X->vm.i.base;
-		X->vm.pc = 0;
-		vm_exec(&X->vm);
-		X->vm.i.p = X->vm.i.base;
-		X->vm.i.pe = pe;
-	}
+	return any;
+} /* rev_number() */
 
-	return 0;
-error:
-	return error;
-} /* hxd_flush() */
 
+static inline void rev_store(unsigned char *dst, uint64_t v, int bytes, int flags) {
+	int i;
 
-size_t hxd_read(struct hexdump *X, void *dst, size_t lim) {
-	unsigned char *p, *pe, *op;
-	size_t n;
+	if (HXD_BYTEORDER(flags) == HXD_BIG_ENDIAN) {
+		for (i = bytes; i-- > 0; v >>= 8)
+			dst[i] = 0xff & v;
+	} else {
+		for (i = 0; i < bytes; i++, v >>= 8)
+			dst[i] = 0xff & v;
+	}
+} /* rev_store() */
 
-	p = dst;
-	pe = p + lim;
-	op = X->vm.o.base;
 
-	while (p < pe && op < X->vm.o.p) {
-		n = MIN(pe - p, X->vm.o.p - op);
-		memcpy(p, op, n);
-		p += n;
-		op += n;
+/*
+ * Fast path for units of literals around one fixed-width hex field, like
+ * 16/1 "%02x " or "0x%02x, ", and for runs of %_p or %c. Iterations are
+ * decoded while they match exactly, leaving anything else, e.g. a chopped
+ * final separator, to rev_block(). Returns the iterations decoded.
+ */
+static int rev_fastunit(struct hexdump *X, struct rev_cursor *C, const struct ir_unit *U, unsigned char *blk, size_t *pos, size_t n) {
+	const struct ir_item *I, *F = NULL;
+	const struct ir_item *Ib = &X->ir->item[U->item], *Ie = &Ib[U->nitem];
+	const unsigned char *p = C->p, *q;
+	unsigned char pre[16], suf[16];
+	size_t npre = 0, nsuf = 0, len;
+	unsigned d, x;
+	uint64_t v;
+	int loop, k;
+
+	if (U->pad)
+		return 0;
+
+	if (U->nitem == 1 && (Ib->fc == FC('_', 'p') || Ib->fc == 'c') && Ib->width <= 1) {
+		loop = MIN((size_t)U->loop, (n - MIN(*pos, n)) / MAX(Ib->bytes, 1));
+		loop = MIN((size_t)loop, (size_t)(C->pe - p));
+		C->p += loop;
+		*pos += (size_t)loop * Ib->bytes;
+
+		return loop;
 	}
 
-	n = X->vm.o.p - op;
-	memmove(X->vm.o.base, op, n);
-	X->vm.o.p = &X->vm.o.base[n];
+	for (I = Ib; I < Ie; I++) {
+		if (!I->fc) {
+			if (!F && npre < sizeof pre)
+				pre[npre++] = I->chr;
+			else if (F && nsuf < sizeof suf)
+				suf[nsuf++] = I->chr;
+			else
+				return 0;
+		} else if (!F && rev_base(I->fc) == 16 && !rev_isaddr(I->fc) && I->width == 2 * I->bytes && !(I->flags & F_HASH)) {
+			F = I;
+		} else {
+			return 0;
+		}
+	}
 
-	return p - (unsigned char *)dst;
-} /* hxd_read() */
+	if (!F)
+		return 0;
 
+	len = npre + F->width + nsuf;
 
-const char *hxd_strerror(int error) {
-	static const char *txt[] = {
-		[HXD_EFORMAT - HXD_EBASE] = "invalid format",
-		[HXD_EDRAINED - HXD_EBASE] = "unit drains buffer",
-		[HXD_ENOTSUPP - HXD_EBASE] = "unsupported conversion sequence",
-		[HXD_EOOPS - HXD_EBASE] = "machine traps",
-	};
+	for (loop = 0; loop < U->loop && *pos + F->bytes <= n && (size_t)(C->pe - p) >= len; loop++) {
+		q = p;
 
-	if (error >= 0)
-		return strerror(error);
+		for (k = 0; (size_t)k < npre; k++) {
+			if (q[k] != pre[k])
+				goto done;
+		}
 
-	if (error >= HXD_EBASE && error < HXD_ELAST) {
-		error -= HXD_EBASE;
+		q += npre;
 
-		if (error < (int)countof(txt) && txt[error])
-			return txt[error];
+		/* digit values are one too high, so an invalid digit is 0 */
+		for (v = 0, x = 1, k = 0; k < F->width; k++) {
+			d = rev_digit[q[k]];
+			x &= (d + 0xf) >> 4;
+			v = (v << 4) | ((d - 1) & 0xf);
+		}
+
+		if (!x)
+			goto done;
+
+		q += F->width;
+
+		for (k = 0; (size_t)k < nsuf; k++) {
+			if (q[k] != suf[k])
+				goto done;
+		}
+
+		if (F->bytes == 1)
+			blk[*pos] = v;
+		else
+			rev_store(&blk[*pos], v, F->bytes, X->vm.flags);
+
+		*pos += F->bytes;
+		p = q + nsuf;
 	}
+done:
+	C->p = p;
 
-	return "unknown error (hexdump)";
-} /* hxd_strerror() */
+	return loop;
+} /* rev_fastunit() */
 
 
-int hxd_version(void) {
-	return HXD_VERSION;
-} /* hxd_version() */
+/*
+ * Parse the text of one block into blk, returning the number of octets
+ * it held. Sets *addr to the block address if an address was printed.
+ */
+static size_t rev_block(struct hexdump *X, struct rev_cursor *C, unsigned char *blk, uint64_t *addr, _Bool *hasaddr) {
+	const struct ir *ir = X->ir;
+	const struct ir_line *L;
+	const struct ir_unit *U;
+	const struct ir_item *I, *J, *Ie;
+	const unsigned char *mark;
+	size_t n = X->vm.blocksize, pos, start;
+	uint64_t v;
+	int loop, k;
+
+	memset(blk, 0, X->vm.blocksize);
+
+	for (L = ir->line; L < &ir->line[ir->nline]; L++) {
+		pos = 0;
+
+		for (U = &ir->unit[L->unit]; U < &ir->unit[L->unit + L->nunit]; U++) {
+			if (U->isend)
+				continue;
+
+			Ie = &ir->item[U->item + U->nitem];
+
+			for (loop = rev_fastunit(X, C, U, blk, &pos, n); loop < U->loop; loop++) {
+				if ((U->flags & HXD_NOPADDING) && pos + unit_size(U) > n)
+					break;
+
+				mark = C->p;
+				start = pos;
+
+				for (I = &ir->item[U->item]; I < Ie; I++) {
+					if (!I->fc) {
+						if (I->chr == ' ' || I->chr == '\t') {
+							for (J = I; J + 1 < Ie && !J[1].fc && (J[1].chr == ' ' || J[1].chr == '\t'); J++)
+								;;
+							rev_skipws(C, J - I + 1);
+							I = J;
+						} else if (I->chr == '\n') {
+							rev_skipws(C, (size_t)-1);
+
+							if (rev_peek(C) == '\r')
+								C->p++;
+							if (rev_peek(C) != '\n')
+								goto chopped;
+
+							C->p++;
+						} else if (rev_peek(C) == I->chr) {
+							C->p++;
+						} else {
+							goto chopped;
+						}
+					} else if (rev_isaddr(I->fc)) {
+						if (rev_number(C, rev_base(I->fc), 0, 0, &v) && !*hasaddr) {
+							*addr = v - pos;
+							*hasaddr = 1;
+						}
+					} else if (pos >= n) {
+						/* padded, or nothing if unpadded */
+						rev_skipws(C, MAX(I->width, 0));
+						pos += I->bytes;
+					} else if (!rev_base(I->fc)) {
+						for (k = 0; k < MAX(I->width, 1) && rev_peek(C) >= 0; k++)
+							C->p++;
+						pos += I->bytes;
+					} else if (!rev_number(C, rev_base(I->fc), I->fc == 'd' || I->fc == 'i', rev_width(I), &v)) {
+						n = pos;
+						pos += I->bytes;
+					} else {
+						rev_store(&blk[pos], v, I->bytes, X->vm.flags);
+						pos += I->bytes;
+					}
+				}
 
+				pos += U->pad;
 
-const char *hxd_vendor(void) {
-	return HXD_VENDOR;
-} /* hxd_vendor() */
+				continue;
+chopped:
+				/*
+				 * The rest of a short block. A later line cut before
+				 * its first field, like a -C line missing its ascii
+				 * column, says nothing of the length, so keep what
+				 * the earlier lines decoded.
+				 */
+				C->p = mark;
+				pos = start;
 
+				if (pos || L == ir->line)
+					n = MIN(n, pos);
 
-int hxd_v_rel(void) {
-	return HXD_V_REL;
-} /* hxd_v_rel() */
+				break;
+			}
+		}
+	}
 
+	return n;
+} /* rev_block() */
 
-int hxd_v_abi(void) {
-	return HXD_V_ABI;
-} /* hxd_v_abi() */
 
+/* parse blocks from text in [p, pe), returning where parsing stopped */
+static const unsigned char *rev_parse(struct hexdump *X, const unsigned char *p, const unsigned char *pe, _Bool eof) {
+	struct rev_cursor C = { p, pe, eof, 0 };
+	size_t blocksize = X->vm.blocksize, n;
+	unsigned char *blk = X->vm.i.base, *last = &blk[blocksize];
+	const unsigned char *start;
+	_Bool hasaddr;
+	uint64_t addr = 0;
+	int ch;
 
-int hxd_v_api(void) {
-	return HXD_V_API;
-} /* hxd_v_api() */
+	while (rev_peek(&C) >= 0) {
+		start = C.p;
 
+		if (rev_peek(&C) == '*') {
+			C.p++;
+			rev_skipws(&C, (size_t)-1);
 
-#if HEXDUMP_LUALIB
+			if (rev_peek(&C) == '\r')
+				C.p++;
 
-#include <lua.h>
-#include <lauxlib.h>
+			if (rev_peek(&C) == '\n') {
+				C.p++;
+				X->rev.repeat = 1;
 
-#if WITH_LUA_VERSION_NUM && WITH_LUA_VERSION_NUM != LUA_VERSION_NUM
-#error Lua headers do not implement expected API
-#endif
+				continue;
+			} else if (C.starved) {
+				C.p = start;
 
-#define HEXDUMP_CLASS "HEXDUMP*"
+				break;
+			}
 
+			C.p = start;
+		}
 
-static inline struct hexdump *hxdL_checkudata(lua_State *L, int index) {
-	return *(struct hexdump **)luaL_checkudata(L, index, HEXDUMP_CLASS);
-} /* hxdL_checkudata() */
+		hasaddr = 0;
+		n = rev_block(X, &C, blk, &addr, &hasaddr);
 
+		if (C.starved) {
+			C.p = start;
 
-static struct hexdump *hxdL_push(lua_State *L) {
-	struct hexdump **X;
-	int error;
+			break;
+		}
 
-	X = lua_newuserdata(L, sizeof *X);
-	*X = NULL;
+		if (hasaddr && X->rev.repeat && X->rev.started) {
+			while (X->rev.address < addr) {
+				size_t count = MIN(addr - X->rev.address, blocksize);
 
-	luaL_getmetatable(L, HEXDUMP_CLASS);
-	lua_setmetatable(L, -2);
+				vm_reserve(&X->vm, count);
+				memcpy(X->vm.o.p, last, count);
+				X->vm.o.p += count;
+				X->rev.address += count;
+			}
+		}
 
-	if (!(*X = hxd_open(&error)))
-		luaL_error(L, "hexdump: %s", hxd_strerror(error));
+		X->rev.repeat = 0;
 
-	return *X;
-} /* hxdL_push() */
+		if (!n) {
+			/* nothing decoded, e.g. a final address; skip the line */
+			if (C.p == start) {
+				while ((ch = rev_peek(&C)) >= 0 && ch != '\n')
+					C.p++;
 
+				if (ch == '\n') {
+					C.p++;
+				} else if (C.starved) {
+					C.p = start;
 
-static int hxdL_apply(lua_State *L) {
-	const char *fmt, *p, *pe;
-	size_t n;
-	struct hexdump *X;
-	luaL_Buffer B;
-	int top = lua_gettop(L), data = 2, flags = 0;
-	int error;
+					break;
+				}
+			}
 
-	fmt = luaL_checkstring(L, 1);
+			continue;
+		}
 
-	if (lua_type(L, 2) == LUA_TNUMBER) {
-		flags = lua_tointeger(L, 2);
-		data = 3;
+		vm_reserve(&X->vm, n);
+		memcpy(X->vm.o.p, blk, n);
+		X->vm.o.p += n;
+		memcpy(last, blk, blocksize);
+
+		X->rev.address = ((hasaddr)? addr : X->rev.address) + n;
+		X->rev.started = 1;
+		X->vm.stats.blocks++;
 	}
 
-	lua_pushvalue(L, 1);
-	lua_rawget(L, lua_upvalueindex(1));
+	return C.p;
+} /* rev_parse() */
 
-	if (lua_isnil(L, -1)) {
-		lua_pop(L, 1);
 
-		lua_newtable(L);
+/* append unparsed text */
+static void rev_stash(struct hexdump *X, const unsigned char *src, size_t len) {
+	size_t n = X->rev.pe - X->rev.p, size;
+	unsigned char *tmp;
 
-		lua_pushvalue(L, 1);
-		lua_pushvalue(L, -2);
-		lua_rawset(L, lua_upvalueindex(1));
+	if ((size_t)(X->rev.lim - X->rev.pe) < len) {
+		memmove(X->rev.base, X->rev.p, n);
+		X->rev.p = X->rev.base;
+		X->rev.pe = &X->rev.base[n];
 	}
 
-	lua_rawgeti(L, -1, flags);
+	if ((size_t)(X->rev.lim - X->rev.pe) < len) {
+		size = MAX(X->rev.lim - X->rev.base, 64);
 
-	if (lua_isnil(L, -1)) {
-		lua_pop(L, 1);
+		do {
+			if (~size < size)
+				vm_throw(&X->vm, ENOMEM);
 
-		X = hxdL_push(L);
+			size *= 2;
+		} while (size - n < len);
 
-		if ((error = hxd_compile(X, fmt, flags)))
-			goto error;
+		if (!(tmp = realloc(X->rev.base, size)))
+			vm_throw(&X->vm, errno);
+
+		X->rev.base = tmp;
+		X->rev.p = tmp;
+		X->rev.pe = &tmp[n];
+		X->rev.lim = &tmp[size];
+	}
+
+	memcpy(X->rev.pe, src, len);
+	X->rev.pe += len;
+} /* rev_stash() */
 
-		lua_pushvalue(L, -1);
-		lua_rawseti(L, -3, flags);
+
+static void rev_write(struct hexdump *X, const unsigned char *src, size_t len) {
+	const unsigned char *p;
+
+	if (X->rev.p == X->rev.pe) {
+		/* parse straight from the caller's text */
+		p = rev_parse(X, src, src + len, 0);
+		rev_stash(X, p, (src + len) - p);
 	} else {
-		X = hxdL_checkudata(L, -1);
+		rev_stash(X, src, len);
+		X->rev.p = (unsigned char *)rev_parse(X, X->rev.p, X->rev.pe, 0);
 	}
+} /* rev_write() */
 
-	hxd_reset(X);
 
-	luaL_buffinit(L, &B);
+static void rev_flush(struct hexdump *X) {
+	rev_parse(X, X->rev.p, X->rev.pe, 1);
 
-	for (; data <= top; data++) {
-		p = luaL_checklstring(L, data, &n);
-		pe = p + n;
+	X->rev.p = X->rev.base;
+	X->rev.pe = X->rev.base;
+} /* rev_flush() */
 
-		while (p < pe) {
-			n = MIN(pe - p, 1024);
 
-			if ((error = hxd_write(X, p, n)))
-				goto error;
+int hxd_compile(struct hexdump *X, const char *fmt, int flags) {
+	struct ir *volatile ir;
+	unsigned char *tmp;
+	int error;
 
-			p += n;
+	/* escape sequences don't belong in JSON, nor escapes in reverse mode */
+	if ((flags & HXD_JSON) && (flags & (HXD_COLOR | HXD_REVERSE)))
+		return HXD_ENOTSUPP;
 
-			while ((n = hxd_read(X, luaL_prepbuffer(&B), LUAL_BUFFERSIZE)))
-				luaL_addsize(&B, n);
-		}
-	}
+	hxd_reset(X);
+	X->vm.epilogue = 0;
 
-	if ((error = hxd_flush(X)))
+	if (!(ir = ir_open(strlen(fmt) + 1)))
+		goto syerr;
+
+	if ((error = vm_enter(&X->vm)))
 		goto error;
 
-	while ((n = hxd_read(X, luaL_prepbuffer(&B), LUAL_BUFFERSIZE)))
-		luaL_addsize(&B, n);
+	X->vm.flags = flags;
 
-	luaL_pushresult(&B);
+	if (!HXD_BYTEORDER(X->vm.flags)) {
+		union { int i; char c; } u = { 0 };
 
-	return 1;
-error:
-	return luaL_error(L, "hexdump: %s", hxd_strerror(error));
-} /* hxdL_apply() */
+		u.c = 1;
+		X->vm.flags |= (u.i & 0xff)? HXD_LITTLE_ENDIAN : HXD_BIG_ENDIAN;
+	}
 
+	parse_format(&X->vm, ir, (const unsigned char *)fmt);
+	emit_format(&X->vm, ir);
 
-static int hxdL__call(lua_State *L) {
-	lua_pushvalue(L, lua_upvalueindex(1));
-	lua_replace(L, 1);
+	if (flags & HXD_REVERSE)
+		rev_check(&X->vm, ir);
 
-	lua_call(L, lua_gettop(L) - 1, 1);
+	X->vm.blocksize = ir->blocksize;
+	X->vm.outsize = ir->outsize;
 
-	return 1;
-} /* hxdL__call() */
+	/* input must still be consumed if only the epilogue prints */
+	if (!X->vm.blocksize && ir->end)
+		X->vm.blocksize = 1;
 
+	/* reverse mode keeps the previous block after the current one */
+	if (!(tmp = realloc(X->vm.i.base, X->vm.blocksize * ((flags & HXD_REVERSE)? 2 : 1))))
+		goto syerr;
 
-static int hxdL_new(lua_State *L) {
-	hxdL_push(L);
+	X->vm.i.base = tmp;
+	X->vm.i.p = tmp;
+	X->vm.i.pe = &tmp[X->vm.blocksize];
 
-	return 1;
-} /* hxdL_new() */
+	/* ir is left untouched after vm_enter() so the error path may free it */
+	ir_close(X->ir);
+	X->ir = NULL;
 
+	if (flags & HXD_REVERSE)
+		X->ir = ir;
+	else
+		ir_close(ir);
 
-static int hxdL_compile(lua_State *L) {
-	struct hexdump *X = hxdL_checkudata(L, 1);
-	const char *fmt = luaL_checkstring(L, 2);
-	int flags = (int)luaL_optinteger(L, 3, 0);
-	int error;
+	return 0;
+syerr:
+	error = errno;
+error:
+	ir_close(ir);
+	ir_close(X->ir);
+	X->ir = NULL;
+	hxd_reset(X);
+	memset(X->vm.code, 0, sizeof X->vm.code);
+	X->vm.epilogue = 0;
 
-	if ((error = hxd_compile(X, fmt, flags)))
-		return luaL_error(L, "hexdump: %s", hxd_strerror(error));
+	return error;
+} /* hxd_compile() */
 
-	lua_pushboolean(L, 1);
 
-	return 1;
-} /* hxdL_compile() */
+/*
+ * Program images. A header of little-endian 32-bit words, the code up to
+ * the trailing TRAPs, and an FNV-1a hash of everything before it. Opcode
+ * numbering isn't stable, so an image only loads into the release, ABI
+ * and API revision that saved it. Reverse mode interprets the IR rather
+ * than the code and so can't be saved.
+ */
+#define IMG_MAGIC   0x43445848 /* "HXDC" */
+#define IMG_HDRSIZE (9 * 4)
+#define IMG_SUMSIZE 8
 
+static uint64_t fnv1a(uint64_t h, const void *src, size_t len) {
+	const unsigned char *p = src, *pe = p + len;
 
-static int hxdL_blocksize(lua_State *L) {
-	struct hexdump *X = hxdL_checkudata(L, 1);
+	while (p < pe) {
+		h ^= *p++;
+		h *= 0x100000001b3ULL;
+	}
 
-	lua_pushnumber(L, hxd_blocksize(X));
+	return h;
+} /* fnv1a() */
 
-	return 1;
-} /* hxdL_blocksize() */
+#define FNV1A_INIT 0xcbf29ce484222325ULL
 
 
-static int hxdL_write(lua_State *L) {
-	struct hexdump *X = hxdL_checkudata(L, 1);
-	const char *data;
-	size_t size;
-	int error;
+static void img_put(unsigned char *p, uint64_t v, int n) {
+	while (n-- > 0) {
+		*p++ = 0xff & v;
+		v >>= 8;
+	}
+} /* img_put() */
 
-	data = luaL_checklstring(L, 2, &size);
 
-	if ((error = hxd_write(X, data, size)))
-		return luaL_error(L, "hexdump: %s", hxd_strerror(error));
+static uint64_t img_get(const unsigned char *p, int n) {
+	uint64_t v = 0;
 
-	lua_pushboolean(L, 1);
+	while (n-- > 0)
+		v = (v << 8) | p[n];
 
-	return 1;
-} /* hxdL_write() */
+	return v;
+} /* img_get() */
 
 
-static int hxdL_flush(lua_State *L) {
-	struct hexdump *X = hxdL_checkudata(L, 1);
-	int error;
+/*
+ * Operand octets and stack effect of each instruction, for img_verify().
+ */
+static const struct {
+	unsigned char operand, pops, pushes;
+} img_op[] = {
+	[OP_HALT]    = { 0, 0, 0 },
+	[OP_NOOP]    = { 0, 0, 0 },
+	[OP_TRAP]    = { 0, 0, 0 },
+	[OP_PC]      = { 0, 0, 1 },
+	[OP_TRUE]    = { 0, 0, 1 },
+	[OP_FALSE]   = { 0, 0, 1 },
+	[OP_ZERO]    = { 0, 0, 1 },
+	[OP_ONE]     = { 0, 0, 1 },
+	[OP_TWO]     = { 0, 0, 1 },
+	[OP_I8]      = { 1, 0, 1 },
+	[OP_I16]     = { 2, 0, 1 },
+	[OP_I32]     = { 4, 0, 1 },
+	[OP_NEG]     = { 0, 1, 1 },
+	[OP_SUB]     = { 0, 2, 1 },
+	[OP_ADD]     = { 0, 2, 1 },
+	[OP_NOT]     = { 0, 1, 1 },
+	[OP_OR]      = { 0, 2, 1 },
+	[OP_LT]      = { 0, 2, 1 },
+	[OP_POP]     = { 0, 1, 0 },
+	[OP_DUP]     = { 0, 1, 2 },
+	[OP_SWAP]    = { 0, 2, 2 },
+	[OP_READ]    = { 0, 1, 1 },
+	[OP_COUNT]   = { 0, 0, 1 },
+	[OP_PUTC]    = { 1, 0, 0 },
+	[OP_CONV]    = { 0, 5, 0 },
+	[OP_CHOP]    = { 0, 1, 0 },
+	[OP_PAD]     = { 0, 1, 0 },
+	[OP_JMP]     = { 0, 2, 0 },
+	[OP_RESET]   = { 0, 0, 0 },
+	[OP_2XBYTE]  = { 0, 0, 0 },
+	[OP_PBYTE]   = { 0, 0, 0 },
+	[OP_7XADDR]  = { 0, 0, 0 },
+	[OP_8XADDR]  = { 0, 0, 0 },
+	[OP_LE16]    = { 0, 0, 1 },
+	[OP_BE16]    = { 0, 0, 1 },
+	[OP_LE32]    = { 0, 0, 1 },
+	[OP_BE32]    = { 0, 0, 1 },
+	[OP_LE64]    = { 0, 0, 1 },
+	[OP_BE64]    = { 0, 0, 1 },
+	[OP_COLOR]   = { 0, 0, 0 },
+	[OP_NOCOLOR] = { 0, 0, 0 },
+	[OP_JCBYTE]  = { 0, 0, 0 },
+	[OP_JPBYTE]  = { 0, 0, 0 },
+};
+
+#define IMG_INSN 1 /* instruction boundary */
+#define IMG_LINK 2 /* inside a jump sequence laid down by emit_link() */
+
+/*
+ * Check that code loaded from an image can't take the machine anywhere
+ * emit_format() couldn't: every opcode is known and its operand complete,
+ * every JMP is reached only through the PC-relative sequence emit_link()
+ * lays down and lands on an instruction, and along every path the stack
+ * stays within bounds and is empty at HALT. The checksum only catches
+ * accidents; this is what makes a forged image harmless.
+ */
+static _Bool img_verify(const unsigned char *code, size_t ncode, size_t epilogue) {
+	unsigned char mark[sizeof ((struct vm_state *)0)->code] = { 0 };
+	signed char depth[sizeof mark];
+	unsigned short work[sizeof mark];
+	size_t pc, n = 0;
+	int d;
+
+	for (pc = 0; pc < ncode; pc += 1 + img_op[code[pc]].operand) {
+		if (code[pc] >= countof(img_op) || pc + img_op[code[pc]].operand >= ncode)
+			return 0;
 
-	if ((error = hxd_flush(X)))
-		return luaL_error(L, "hexdump: %s", hxd_strerror(error));
+		mark[pc] = IMG_INSN;
+	}
 
-	lua_pushboolean(L, 1);
+	for (pc = 0; pc < ncode; pc++) {
+		if (mark[pc] != IMG_INSN || code[pc] != OP_JMP)
+			continue;
 
-	return 1;
-} /* hxdL_flush() */
+		if (pc < 5 || mark[pc - 5] != IMG_INSN || code[pc - 5] != OP_PC
+		||  mark[pc - 4] != IMG_INSN || code[pc - 4] != OP_I16
+		||  mark[pc - 1] != IMG_INSN || (code[pc - 1] != OP_ADD && code[pc - 1] != OP_SUB))
+			return 0;
+
+		mark[pc - 4] = IMG_LINK;
+		mark[pc - 1] = IMG_LINK;
+		mark[pc] = IMG_LINK;
+	}
 
+	if (epilogue && (epilogue >= ncode || mark[epilogue] != IMG_INSN))
+		return 0;
 
-static int hxdL_read(lua_State *L) {
-	struct hexdump *X = hxdL_checkudata(L, 1);
-	luaL_Buffer B;
-	size_t count;
+	memset(depth, -1, sizeof depth);
+
+	depth[0] = 0;
+	work[n++] = 0;
+
+	if (epilogue) {
+		depth[epilogue] = 0;
+		work[n++] = epilogue;
+	}
+
+	while (n > 0) {
+		pc = work[--n];
+		d = depth[pc];
+
+		while (pc < ncode) { /* past ncode is OP_TRAP */
+			unsigned char op = code[pc];
+
+			if (d < img_op[op].pops)
+				return 0;
+
+			if (op == OP_HALT) {
+				if (d != 0)
+					return 0;
+
+				break;
+			} else if (op == OP_TRAP) {
+				break;
+			}
+
+			d += img_op[op].pushes - img_op[op].pops;
 
-	luaL_buffinit(L, &B);
+			if (d > (int)countof(((struct vm_state *)0)->stack))
+				return 0;
+
+			if (op == OP_JMP) {
+				size_t k = (code[pc - 3] << 8) | code[pc - 2];
+				size_t to;
+
+				if (code[pc - 1] == OP_ADD) {
+					to = pc - 5 + k;
+				} else {
+					if (k > pc - 5)
+						return 0;
+
+					to = pc - 5 - k;
+				}
+
+				if (to >= ncode || mark[to] != IMG_INSN)
+					return 0;
+
+				if (depth[to] == -1) {
+					depth[to] = d;
+					work[n++] = to;
+				} else if (depth[to] != d) {
+					return 0;
+				}
+			}
 
-	while ((count = hxd_read(X, luaL_prepbuffer(&B), LUAL_BUFFERSIZE)))
-		luaL_addsize(&B, count);
+			if ((pc += 1 + img_op[op].operand) >= sizeof mark)
+				return 0;
 
-	luaL_pushresult(&B);
+			if (depth[pc] == -1) {
+				depth[pc] = d;
+			} else if (depth[pc] != d) {
+				return 0;
+			} else {
+				break;
+			}
+		}
+	}
 
 	return 1;
-} /* hxdL_read() */
+} /* img_verify() */
 
 
-static int hxdL__gc(lua_State *L) {
-	struct hexdump **X = luaL_checkudata(L, 1, HEXDUMP_CLASS);
+size_t hxd_save(struct hexdump *X, void *dst, size_t lim) {
+	unsigned char *p = dst;
+	size_t ncode = sizeof X->vm.code, size;
+
+	if (X->ir)
+		return 0;
+
+	while (ncode > 0 && X->vm.code[ncode - 1] == OP_TRAP)
+		ncode--;
+
+	size = IMG_HDRSIZE + ncode + IMG_SUMSIZE;
+
+	if (size > lim)
+		return size;
+
+	img_put(&p[0], IMG_MAGIC, 4);
+	img_put(&p[4], HXD_V_REL, 4);
+	img_put(&p[8], HXD_V_ABI, 4);
+	img_put(&p[12], HXD_V_API, 4);
+	img_put(&p[16], X->vm.flags, 4);
+	img_put(&p[20], X->vm.blocksize, 4);
+	img_put(&p[24], X->vm.outsize, 4);
+	img_put(&p[28], X->vm.epilogue, 4);
+	img_put(&p[32], ncode, 4);
+	memcpy(&p[IMG_HDRSIZE], X->vm.code, ncode);
+	img_put(&p[IMG_HDRSIZE + ncode], fnv1a(FNV1A_INIT, p, IMG_HDRSIZE + ncode), IMG_SUMSIZE);
+
+	return size;
+} /* hxd_save() */
+
+
+int hxd_load(struct hexdump *X, const void *src, size_t len) {
+	const unsigned char *p = src;
+	size_t blocksize, ncode;
+	unsigned char *tmp;
+	int flags, epilogue;
+
+	if (len < IMG_HDRSIZE + IMG_SUMSIZE)
+		return HXD_EIMAGE;
+
+	if (img_get(&p[0], 4) != IMG_MAGIC
+	||  img_get(&p[4], 4) != HXD_V_REL
+	||  img_get(&p[8], 4) != HXD_V_ABI
+	||  img_get(&p[12], 4) != HXD_V_API)
+		return HXD_EIMAGE;
+
+	flags = img_get(&p[16], 4);
+	blocksize = img_get(&p[20], 4);
+	epilogue = img_get(&p[28], 4);
+	ncode = img_get(&p[32], 4);
+
+	if (ncode > sizeof X->vm.code || len != IMG_HDRSIZE + ncode + IMG_SUMSIZE)
+		return HXD_EIMAGE;
 
-	hxd_close(*X);
-	*X = NULL;
+	if (img_get(&p[IMG_HDRSIZE + ncode], IMG_SUMSIZE) != fnv1a(FNV1A_INIT, p, IMG_HDRSIZE + ncode))
+		return HXD_EIMAGE;
+
+	if ((flags & HXD_REVERSE) || !img_verify(&p[IMG_HDRSIZE], ncode, epilogue))
+		return HXD_EIMAGE;
+
+	if (!(tmp = realloc(X->vm.i.base, blocksize)))
+		return errno;
+
+	hxd_reset(X);
+	ir_close(X->ir);
+	X->ir = NULL;
+
+	X->vm.i.base = tmp;
+	X->vm.i.p = tmp;
+	X->vm.i.pe = &tmp[blocksize];
+
+	X->vm.flags = flags;
+	X->vm.blocksize = blocksize;
+	X->vm.outsize = img_get(&p[24], 4);
+	X->vm.epilogue = epilogue;
+
+	memcpy(X->vm.code, &p[IMG_HDRSIZE], ncode);
+	memset(&X->vm.code[ncode], OP_TRAP, sizeof X->vm.code - ncode);
 
 	return 0;
-} /* hxdL__gc() */
+} /* hxd_load() */
 
 
-static const luaL_Reg hxdL_methods[] = {
-	{ "compile",   &hxdL_compile },
-	{ "blocksize", &hxdL_blocksize },
-	{ "write",     &hxdL_write },
-	{ "flush",     &hxdL_flush },
-	{ "read",      &hxdL_read },
-	{ NULL,        NULL },
-}; /* hxdL_methods[] */
+/*
+ * Ahead-of-time compiler. Translates the IR to a C function equivalent to
+ * the code emit_format() generates, with every loop unrolled and the read
+ * pointer and padding checks of the machine made explicit. The generated
+ * source depends only on the C library, and renders conversions through
+ * the same printf(3) formats as vm_conv().
+ */
+static const char gen_runtime[] =
+	"#include <stddef.h>\n"
+	"#include <stdint.h>\n"
+	"#include <stdio.h>\n"
+	"#include <string.h>\n"
+	"\n"
+	"#ifndef HXDG_NOTUSED\n"
+	"#if __GNUC__\n"
+	"#define HXDG_NOTUSED __attribute__((unused))\n"
+	"#else\n"
+	"#define HXDG_NOTUSED\n"
+	"#endif\n"
+	"#endif\n"
+	"\n"
+	"HXDG_NOTUSED static uint64_t hxdg_load(const unsigned char **p, const unsigned char *pe, size_t n, int big) {\n"
+	"\tuint64_t v = 0;\n"
+	"\tsize_t i;\n"
+	"\n"
+	"\tif (n > (size_t)(pe - *p))\n"
+	"\t\tn = pe - *p;\n"
+	"\n"
+	"\tif (big) {\n"
+	"\t\tfor (i = 0; i < n; i++)\n"
+	"\t\t\tv = (v << 8) | (*p)[i];\n"
+	"\t} else {\n"
+	"\t\tfor (i = (n < 8)? n : 8; i > 0; i--)\n"
+	"\t\t\tv = (v << 8) | (*p)[i - 1];\n"
+	"\t}\n"
+	"\n"
+	"\t*p += n;\n"
+	"\n"
+	"\treturn v;\n"
+	"}\n"
+	"\n"
+	"HXDG_NOTUSED static int hxdg_native(void) {\n"
+	"\tunion { int i; char c; } u = { 0 };\n"
+	"\n"
+	"\tu.c = 1;\n"
+	"\n"
+	"\treturn !(u.i & 0xff);\n"
+	"}\n"
+	"\n"
+	"HXDG_NOTUSED static unsigned char hxdg_print(unsigned char chr) {\n"
+	"\treturn (chr > 0x1f && chr < 0x7f)? chr : '.';\n"
+	"}\n"
+	"\n"
+	"HXDG_NOTUSED static const char *hxdg_octal(char buf[4], unsigned char chr) {\n"
+	"\tif (chr > 0x1f && chr < 0x7f) {\n"
+	"\t\tbuf[0] = chr;\n"
+	"\t\tbuf[1] = '\\0';\n"
+	"\t} else if (chr == 0 || (chr >= '\\a' && chr <= '\\r')) {\n"
+	"\t\tbuf[0] = '\\\\';\n"
+	"\t\tbuf[1] = \"0\\0\\0\\0\\0\\0\\0abtnvfr\"[chr];\n"
+	"\t\tbuf[2] = '\\0';\n"
+	"\t} else {\n"
+	"\t\tbuf[0] = \"01234567\"[0x7 & (chr >> 6)];\n"
+	"\t\tbuf[1] = \"01234567\"[0x7 & (chr >> 3)];\n"
+	"\t\tbuf[2] = \"01234567\"[0x7 & (chr >> 0)];\n"
+	"\t\tbuf[3] = '\\0';\n"
+	"\t}\n"
+	"\n"
+	"\treturn buf;\n"
+	"}\n"
+	"\n"
+	"HXDG_NOTUSED static const char *hxdg_short(char buf[4], unsigned char chr) {\n"
+	"\tstatic const char map[][4] = {\n"
+	"\t\t\"nul\", \"soh\", \"stx\", \"etx\", \"eot\", \"enq\", \"ack\", \"bel\",\n"
+	"\t\t\"bs\", \"ht\", \"lf\", \"vt\", \"ff\", \"cr\", \"so\", \"si\",\n"
+	"\t\t\"dle\", \"dc1\", \"dc2\", \"dc3\", \"dc4\", \"nak\", \"syn\", \"etb\",\n"
+	"\t\t\"can\", \"em\", \"sub\", \"esc\", \"fs\", \"gs\", \"rs\", \"us\",\n"
+	"\t};\n"
+	"\n"
+	"\tif (chr <= 0x1f) {\n"
+	"\t\tmemcpy(buf, map[chr], 4);\n"
+	"\t} else if (chr == 0x7f) {\n"
+	"\t\tmemcpy(buf, \"del\", 4);\n"
+	"\t} else if (chr < 0x7f) {\n"
+	"\t\tbuf[0] = chr;\n"
+	"\t\tbuf[1] = '\\0';\n"
+	"\t} else {\n"
+	"\t\tbuf[0] = \"0123456789abcdef\"[0x0f & (chr >> 4)];\n"
+	"\t\tbuf[1] = \"0123456789abcdef\"[0x0f & chr];\n"
+	"\t\tbuf[2] = '\\0';\n"
+	"\t}\n"
+	"\n"
+	"\treturn buf;\n"
+	"}\n"
+	"\n"
+	"HXDG_NOTUSED static char *hxdg_hex(char *d, uint64_t v, int digits) {\n"
+	"\twhile (digits-- > 0)\n"
+	"\t\t*d++ = \"0123456789abcdef\"[0x0f & (v >> (4 * digits))];\n"
+	"\n"
+	"\treturn d;\n"
+	"}\n"
+	"\n"
+	"HXDG_NOTUSED static char *hxdg_jchar(char *d, unsigned char chr) {\n"
+	"\tif (chr == '\"' || chr == '\\\\') {\n"
+	"\t\t*d++ = '\\\\';\n"
+	"\t\t*d++ = chr;\n"
+	"\t} else if (chr > 0x1f && chr < 0x7f) {\n"
+	"\t\t*d++ = chr;\n"
+	"\t} else if (chr >= '\\b' && chr <= '\\r' && chr != '\\v') {\n"
+	"\t\t*d++ = '\\\\';\n"
+	"\t\t*d++ = \"btn-fr\"[chr - '\\b'];\n"
+	"\t} else {\n"
+	"\t\tmemcpy(d, \"\\\\u00\", 4);\n"
+	"\t\td = hxdg_hex(d + 4, chr, 2);\n"
+	"\t}\n"
+	"\n"
+	"\treturn d;\n"
+	"}\n"
+	"\n"
+	"HXDG_NOTUSED static char *hxdg_json(char *d, const char *s, size_t n) {\n"
+	"\twhile (n-- > 0)\n"
+	"\t\td = hxdg_jchar(d, *s++);\n"
+	"\n"
+	"\treturn d;\n"
+	"}\n"
+	"\n"
+	"HXDG_NOTUSED static size_t hxdg_len(int n, size_t lim) {\n"
+	"\treturn (n < 0)? 0 : ((size_t)n >= lim)? lim - 1 : (size_t)n;\n"
+	"}\n"
+	"\n"
+	"HXDG_NOTUSED static double hxdg_float(uint64_t w, int bytes) {\n"
+	"\tuint32_t u32 = w;\n"
+	"\tfloat f;\n"
+	"\tdouble d;\n"
+	"\n"
+	"\tif (bytes == 4) {\n"
+	"\t\tmemcpy(&f, &u32, sizeof f);\n"
+	"\n"
+	"\t\treturn f;\n"
+	"\t}\n"
+	"\n"
+	"\tmemcpy(&d, &w, sizeof d);\n"
+	"\n"
+	"\treturn d;\n"
+	"}\n"
+	"\n";
+
+
+/* write n octets of s as the contents of a C string literal */
+static void gen_quote(FILE *fp, const unsigned char *s, size_t n) {
+	_Bool octal = 0;
+
+	for (; n > 0; s++, n--) {
+		if (*s == '"' || *s == '\\') {
+			fprintf(fp, "\\%c", *s);
+		} else if (*s == '\n') {
+			fputs("\\n", fp);
+		} else if (*s == '\t') {
+			fputs("\\t", fp);
+		} else if (*s > 0x1f && *s < 0x7f && !(octal && *s >= '0' && *s <= '7')) {
+			fputc(*s, fp);
+		} else {
+			fprintf(fp, "\\%.3o", *s);
 
+			octal = 1;
 
-static const luaL_Reg hxdL_metatable[] = {
-	{ "__gc",  &hxdL__gc },
-	{ NULL,    NULL },
-}; /* hxdL_metatable[] */
+			continue;
+		}
 
+		octal = 0;
+	}
+} /* gen_quote() */
 
-static const luaL_Reg hxdL_globals[] = {
-	{ "new",  &hxdL_new },
-	{ NULL,   NULL },
-}; /* hxdL_globals[] */
 
+static void gen_conv(FILE *fp, const struct ir_item *I, int fc, const char *big, _Bool json, const char *indent) {
+	int flags = I->flags, width = I->width, prec = I->prec, bytes = I->bytes;
+	const char *label = NULL;
+	char fmt[32], precarg[16];
+	size_t lim = item_outsize(I) + 1; /* d has room for the bound and a NUL */
 
-static void hxdL_register(lua_State *L, const luaL_Reg *l) {
-#if LUA_VERSION_NUM >= 502
-	luaL_setfuncs(L, l, 0);
-#else
-	luaL_register(L, NULL, l);
-#endif
-} /* hxdL_register() */
+	json = json && istext(fc);
 
+	if (fc == 'x' && bytes == 1 && OK_2XBYTE(flags, width, prec)) {
+		fprintf(fp, "%sd = hxdg_hex(d, *p++, 2);\n", indent);
 
-int luaopen_hexdump(lua_State *L) {
-	static const struct { const char *k; int v; } macro[] = {
-		{ "NATIVE",        HXD_NATIVE },
-		{ "NETWORK",       HXD_NETWORK },
-		{ "BIG_ENDIAN",    HXD_BIG_ENDIAN },
-		{ "LITTLE_ENDIAN", HXD_LITTLE_ENDIAN },
-		{ "NOPADDING",     HXD_NOPADDING },
-	};
-	static const struct { const char *k; const char *v; } predef[] = {
-		{ "b", HEXDUMP_b },
-		{ "c", HEXDUMP_c },
-		{ "C", HEXDUMP_C },
-		{ "d", HEXDUMP_d },
-		{ "o", HEXDUMP_o },
-		{ "x", HEXDUMP_x },
-		{ "i", HEXDUMP_i },
-	};
-	unsigned i;
+		return;
+	} else if (fc == FC('_', 'p') && OK_PBYTE(flags, width, prec)) {
+		if (json)
+			fprintf(fp, "%sd = hxdg_jchar(d, hxdg_print(*p++));\n", indent);
+		else
+			fprintf(fp, "%s*d++ = hxdg_print(*p++);\n", indent);
 
-	if (luaL_newmetatable(L, HEXDUMP_CLASS)) {
-		hxdL_register(L, hxdL_metatable);
-		lua_newtable(L);
-		hxdL_register(L, hxdL_methods);
-		lua_setfield(L, -2, "__index");
+		return;
+	} else if (fc == FC('c') && bytes == 1 && OK_PBYTE(flags, width, prec) && json) {
+		fprintf(fp, "%sd = hxdg_jchar(d, *p++);\n", indent);
+
+		return;
+	} else if (fc == FC('_', 'x') && OK_7XADDR(flags, width, prec)) {
+		fprintf(fp, "%sd = hxdg_hex(d, (size_t)(address + (p - src)), 7);\n", indent);
+
+		return;
+	} else if (fc == FC('_', 'x') && OK_8XADDR(flags, width, prec)) {
+		fprintf(fp, "%sd = hxdg_hex(d, (size_t)(address + (p - src)), 8);\n", indent);
+
+		return;
 	}
 
-	lua_pop(L, 1);
+	if (fc != 's' && bytes > 0)
+		fprintf(fp, "%sw = hxdg_load(&p, pe, %d, %s);\n", indent, bytes, big);
+	else
+		fprintf(fp, "%sw = 0;\n", indent);
 
-	lua_newtable(L);
-	hxdL_register(L, hxdL_globals);
+	flags |= F_WORD(bytes);
 
-	lua_newtable(L); /* cache of compiled formats */
-	lua_pushcclosure(L, &hxdL_apply, 1);
+	switch (fc) {
+	case FC('_', 'c'):
+		label = "hxdg_octal";
+		prec = (prec > 0)? MIN(prec, 3) : 3;
+		fc = 's';
 
-	lua_newtable(L); /* metatable of our global table */
-	lua_pushvalue(L, -2);
-	lua_pushcclosure(L, &hxdL__call, 1);
-	lua_setfield(L, -2, "__call");
-	lua_setmetatable(L, -3);
+		break;
+	case FC('_', 'u'):
+		label = "hxdg_short";
+		prec = (prec > 0)? MIN(prec, 3) : 3;
+		fc = 's';
 
-	lua_setfield(L, -2, "apply"); /* global.apply */
+		break;
+	case FC('_', 'p'):
+		fprintf(fp, "%sw = hxdg_print(w);\n", indent);
+		fc = 'c';
 
-	for (i = 0; i < countof(macro); i++) {
-		lua_pushinteger(L, macro[i].v);
-		lua_setfield(L, -2, macro[i].k);
+		break;
+	case FC('_', 'd'): case FC('_', 'o'): case FC('_', 'x'):
+		fprintf(fp, "%sw = address + (p - src);\n", indent);
+		fc = 0xff & (fc >> 8);
+
+		break;
 	}
 
-	for (i = 0; i < countof(predef); i++) {
-		lua_pushstring(L, predef[i].v);
-		lua_setfield(L, -2, predef[i].k);
+	/* the 0 flag is ignored by integer conversions with a precision */
+	if (prec >= 0 && strchr("diouXx", fc))
+		flags &= ~F_ZERO;
+
+	convfmt(fmt, flags, fc);
+
+	/* a negative precision is as if omitted, so omit it */
+	if (prec < 0 && fc != 's') {
+		char *dot = strstr(fmt, ".*");
+
+		memmove(dot, dot + 2, strlen(dot + 2) + 1);
+		*precarg = '\0';
+	} else {
+		snprintf(precarg, sizeof precarg, "%d, ", prec);
 	}
 
-	lua_pushinteger(L, HXD_VERSION);
-	lua_setfield(L, -2, "VERSION");
+	if (json)
+		fprintf(fp, "%sd = hxdg_json(d, tmp, hxdg_len(snprintf(tmp, %zu, \"", indent, lim);
+	else
+		fprintf(fp, "%sd += hxdg_len(snprintf(d, %zu, \"", indent, lim);
+	gen_quote(fp, (unsigned char *)fmt, strlen(fmt));
+	fprintf(fp, "\", %d, ", MAX(width, 0));
 
-	lua_pushstring(L, HXD_VENDOR);
-	lua_setfield(L, -2, "VENDOR");
+	switch (fc) {
+	case 's':
+		if (label)
+			fprintf(fp, "%d, %s(label, w)", MAX(prec, 0), label);
+		else if (prec <= 0)
+			fputs("(int)(pe - p), (const char *)p", fp);
+		else
+			fprintf(fp, "(pe - p < %d)? (int)(pe - p) : %d, (const char *)p", prec, prec);
 
-	return 1;
-} /* luaopen_hexdump() */
+		break;
+	case 'u':
+		fprintf(fp, "%s(%s)w", precarg, (F_WORDSIZE(flags) > 4)? "unsigned long long" : "unsigned");
 
-#else
+		break;
+	case 'd': case 'i':
+		fprintf(fp, "%s(%s)w", precarg, (F_WORDSIZE(flags) > 4)? "long long" : "int");
 
-int luaopen_hexdump() {
-	abort();
-} /* luaopen_hexdump() */
+		break;
+	case 'o': case 'X': case 'x':
+		fprintf(fp, "%s(%s)w", precarg, (F_WORDSIZE(flags) > 4)? "unsigned long long" : "int");
 
-#endif /* HEXDUMP_LUALIB */
+		break;
+	case 'e': case 'E': case 'f': case 'g': case 'G':
+		fprintf(fp, "%shxdg_float(w, %d)", precarg, F_WORDSIZE(flags));
 
+		break;
+	default:
+		fprintf(fp, "%s(int)w", precarg);
 
-#if HEXDUMP_MAIN
+		break;
+	}
 
-#include <errno.h>  /* ERANGE */
-#include <limits.h> /* LONG_MAX ULONG_MAX */
-#include <stdlib.h> /* strtoul(3) */
-#include <stdio.h>  /* FILE SEEK_SET stdout stderr stdin fprintf(3) fseek(3) */
-#include <string.h> /* strcmp(3) */
+	fprintf(fp, "), %zu)%s;\n", lim, (json)? ")" : "");
+} /* gen_conv() */
 
-#ifdef _WIN32
-#include <fcntl.h>  /* _fcntl(3) _setmode(3) _O_BINARY */
-#endif
 
-#ifndef HAVE_ERR
-#define HAVE_ERR (!_WIN32)
-#endif
+static void gen_unit(FILE *fp, const struct ir *ir, const struct ir_unit *U, _Bool epilogue, const char *big) {
+	const struct ir_item *I, *J;
+	int loop = (epilogue)? 1 : U->loop;
+	int chop = 0, i, fc;
 
-#ifndef HAVE_GETOPT
-#define HAVE_GETOPT (!_WIN32)
-#endif
+	for (i = 0; i < loop; i++) {
+		if (!epilogue && (U->flags & HXD_NOPADDING))
+			fprintf(fp, "\tif (pe - p >= %d) {\n", unit_size(U));
+		else
+			fputs("\t{\n", fp);
 
-#if HAVE_ERR
-#include <err.h>    /* err(3) errx(3) */
-#else
-#include <stdarg.h> /* va_list va_start va_end */
+		chop = 0;
 
-static void warn(const char *fmt, ...) {
-	int error = errno;
-	va_list ap;
-	va_start(ap, fmt);
-	fputs("hexdump: ", stderr);
-	vfprintf(stderr, fmt, ap);
-	fprintf(stderr, ": %s\n", strerror(error));
-	va_end(ap);
-}
+		for (I = &ir->item[U->item]; I < &ir->item[U->item + U->nitem]; I++) {
+			if (!I->fc) {
+				unsigned char lit[64];
+				size_t n = 0;
 
-static void warnx(const char *fmt, ...) {
-	va_list ap;
-	va_start(ap, fmt);
-	fputs("hexdump: ", stderr);
-	vfprintf(stderr, fmt, ap);
-	fputc('\n', stderr);
-	va_end(ap);
-}
+				for (J = I; J < &ir->item[U->item + U->nitem] && !J->fc && n < sizeof lit; J++) {
+					lit[n++] = J->chr;
+					chop = (hxd_isspace(J->chr, 0))? chop + 1 : 0;
+				}
 
-#define err(status, ...) (warn(__VA_ARGS__), exit((status)))
-#define errx(status, ...) (warnx(__VA_ARGS__), exit((status)))
+				fputs("\t\tmemcpy(d, \"", fp);
+				gen_quote(fp, lit, n);
+				fprintf(fp, "\", %d);\n\t\td += %d;\n", (int)n, (int)n);
 
-#endif /* HAVE_ERR */
+				I = J - 1;
 
-#if HAVE_GETOPT
-#include <unistd.h> /* getopt(3) */
-#else
-char *optarg;
-int opterr = 1, optind = 1, optopt;
+				continue;
+			}
 
-#define ENTER                                                           \
-	do {                                                            \
-	static const int pc0 = __LINE__;                                \
-	switch (pc0 + pc) {                                             \
-	case __LINE__: (void)0
+			chop = 0;
+			fc = I->fc;
 
-#define SAVE_AND_DO(do_statement)                                       \
-	do {                                                            \
-		pc = __LINE__ - pc0;                                    \
-		do_statement;                                           \
-		case __LINE__: (void)0;                                 \
-	} while (0)
+			if (epilogue && !(fc = endcnv(fc)))
+				continue;
+
+			if (I->bytes > 0) {
+				fputs("\t\tif (p < pe) {\n", fp);
+				gen_conv(fp, I, fc, big, !!(U->flags & HXD_JSON), "\t\t\t");
+
+				if (I->width > 0 && !(U->flags & HXD_JSON))
+					fprintf(fp, "\t\t} else {\n\t\t\tmemset(d, ' ', %d);\n\t\t\td += %d;\n", I->width, I->width);
+
+				fputs("\t\t}\n", fp);
+			} else {
+				gen_conv(fp, I, fc, big, !!(U->flags & HXD_JSON), "\t\t");
+			}
+		}
+
+		if (!epilogue && U->pad > 0)
+			fprintf(fp, "\t\tp += (pe - p < %d)? pe - p : %d;\n", U->pad, U->pad);
+
+		fputs("\t}\n", fp);
+	}
+
+	if (loop > 1 && chop > 0)
+		fprintf(fp, "\td -= (d - dst < %d)? d - dst : %d;\n", chop, chop);
+} /* gen_unit() */
+
+
+/*
+ * Write C source defining name(), which formats one block like the format
+ * compiled by hxd_compile(), and name_end() if the format has an epilogue.
+ * The context is only used to report errors and must be recompiled.
+ */
+NOTUSED static int hxd_generate(struct hexdump *X, const char *fmt, int flags, const char *name, FILE *fp) {
+	const struct ir_line *L;
+	const struct ir_unit *U;
+	struct ir *ir;
+	const char *big;
+	char tmpdecl[32];
+	size_t blocksize, tmpsize, i;
+	int error;
+
+	if (flags & HXD_COLOR)
+		return HXD_ENOTSUPP;
+
+	hxd_reset(X);
+
+	if (!(ir = ir_open(strlen(fmt) + 1)))
+		return errno;
+
+	if ((error = vm_enter(&X->vm)))
+		goto error;
+
+	X->vm.flags = flags;
+
+	parse_format(&X->vm, ir, (const unsigned char *)fmt);
+
+	switch (HXD_BYTEORDER(flags)) {
+	case HXD_BIG_ENDIAN:
+		big = "1";
+		break;
+	case HXD_LITTLE_ENDIAN:
+		big = "0";
+		break;
+	default:
+		big = "hxdg_native()";
+		break;
+	}
+
+	blocksize = (!ir->blocksize && ir->end)? 1 : ir->blocksize;
+
+	fputs("/* generated by hexdump.c; do not edit */\n", fp);
+	fprintf(fp, "#define %s_FORMAT \"", name);
+	gen_quote(fp, (const unsigned char *)fmt, strlen(fmt));
+	fprintf(fp, "\"\n#define %s_FLAGS 0x%.2x\n", name, (unsigned)flags);
+	fprintf(fp, "#define %s_BLOCKSIZE %zu\n", name, blocksize);
+	fprintf(fp, "#define %s_OUTSIZE %zu /* including a trailing NUL */\n\n", name, ir->outsize + 1);
+	fputs(gen_runtime, fp);
+
+	/* HXD_JSON formats text conversions into tmp, then escapes them */
+	tmpsize = 1;
+
+	for (i = 0; i < ir->nitem; i++) {
+		if (istext(ir->item[i].fc))
+			tmpsize = MAX(tmpsize, item_outsize(&ir->item[i]) + 1);
+	}
+
+	snprintf(tmpdecl, sizeof tmpdecl, ", tmp[%zu]", tmpsize);
+
+	fprintf(fp,
+		"/*\n"
+		" * Format a block of len octets, at most %s_BLOCKSIZE, read at the given\n"
+		" * address. dst must hold %s_OUTSIZE octets. Returns the octets written.\n"
+		" */\n"
+		"size_t %s(char *dst, const unsigned char *src, size_t len, uint64_t address) {\n"
+		"\tconst unsigned char *p = src, *pe = &src[len];\n"
+		"\tchar *d = dst, label[4]%s;\n"
+		"\tuint64_t w;\n"
+		"\n"
+		"\t(void)p;\n"
+		"\t(void)pe;\n"
+		"\t(void)label;\n"
+		"\t(void)w;\n"
+		"\t(void)address;\n"
+		"%s"
+		"\n", name, name, name,
+		(flags & HXD_JSON)? tmpdecl : "",
+		(flags & HXD_JSON)? "\t(void)tmp;\n" : "");
+
+	for (L = ir->line; L < &ir->line[ir->nline]; L++) {
+		fputs("\tp = src;\n", fp);
+
+		for (U = &ir->unit[L->unit]; U < &ir->unit[L->unit + L->nunit]; U++) {
+			if (!U->isend)
+				gen_unit(fp, ir, U, 0, big);
+		}
+	}
+
+	fputs("\n\treturn d - dst;\n}\n", fp);
+
+	if (ir->end) {
+		fprintf(fp,
+			"\n\n"
+			"/*\n"
+			" * Format the epilogue given the total octets formatted, which\n"
+			" * hxd_flush() does once if the total is nonzero.\n"
+			" */\n"
+			"size_t %s_end(char *dst, uint64_t address) {\n"
+			"\tconst unsigned char *src = (const unsigned char *)\"\", *p = src, *pe = src;\n"
+			"\tchar *d = dst, label[4];\n"
+			"\tuint64_t w;\n"
+			"\n"
+			"\t(void)pe;\n"
+			"\t(void)label;\n"
+			"\t(void)w;\n"
+			"\n", name);
+
+		gen_unit(fp, ir, ir->end, 1, big);
+
+		fputs("\n\treturn d - dst;\n}\n", fp);
+	}
+
+	ir_close(ir);
+
+	return (ferror(fp))? EIO : 0;
+error:
+	ir_close(ir);
+
+	return error;
+} /* hxd_generate() */
+
+
+/*
+ * Grow the output buffer so at least n more bytes can be formatted without
+ * reallocation. Used by callers which can estimate the size of their output
+ * up front.
+ */
+NOTUSED static int hxd_reserve(struct hexdump *X, size_t n) {
+	int error;
+
+	if ((error = vm_enter(&X->vm)))
+		return error;
+
+	vm_reserve(&X->vm, n);
+
+	return 0;
+} /* hxd_reserve() */
+
+
+/*
+ * Release output buffer memory beyond lim bytes, or beyond the pending
+ * output if that's larger. Failure to shrink is harmless and ignored.
+ */
+static void hxd_shrink(struct hexdump *X, size_t lim) {
+	size_t size = X->vm.o.pe - X->vm.o.base;
+	size_t p = X->vm.o.p - X->vm.o.base;
+	unsigned char *tmp;
+
+	lim = MAX(lim, p);
+
+	if (size <= lim || X->vm.o.borrowed)
+		return /* void */;
+
+	if (!lim) {
+		free(X->vm.o.base);
+		X->vm.o.base = NULL;
+		X->vm.o.p = NULL;
+		X->vm.o.pe = NULL;
+	} else if ((tmp = realloc(X->vm.o.base, lim))) {
+		X->vm.o.base = tmp;
+		X->vm.o.p = &tmp[p];
+		X->vm.o.pe = &tmp[lim];
+	}
+} /* hxd_shrink() */
+
+
+void hxd_trim(struct hexdump *X) {
+	hxd_shrink(X, 0);
+} /* hxd_trim() */
+
+
+void hxd_retain(struct hexdump *X, size_t lim) {
+	X->retain = lim;
+
+	if (X->retain && X->vm.o.p == X->vm.o.base)
+		hxd_shrink(X, X->retain);
+} /* hxd_retain() */
+
+
+size_t hxd_blocksize(struct hexdump *X) {
+	return X->vm.blocksize;
+} /* hxd_blocksize() */
+
+
+size_t hxd_setout(struct hexdump *X, void *dst, size_t lim) {
+	size_t n = 0;
+
+	if (X->vm.o.borrowed) {
+		n = X->vm.o.p - X->vm.o.base;
+		X->vm.stats.out += n;
+
+		X->vm.o.base = X->own.base;
+		X->vm.o.p = X->own.p;
+		X->vm.o.pe = X->own.pe;
+		X->vm.o.borrowed = 0;
+	}
+
+	if (dst) {
+		X->own.base = X->vm.o.base;
+		X->own.p = X->vm.o.p;
+		X->own.pe = X->vm.o.pe;
+
+		X->vm.o.base = dst;
+		X->vm.o.p = dst;
+		X->vm.o.pe = (unsigned char *)dst + lim;
+		X->vm.o.borrowed = 1;
+	}
+
+	return n;
+} /* hxd_setout() */
+
+
+size_t hxd_outsize(struct hexdump *X, size_t len) {
+	size_t blocks;
+
+	/* reverse mode output depends on the text, not its length */
+	if (X->ir || !X->vm.blocksize)
+		return SIZE_MAX;
+
+	/* each block, a partial one, and the epilogue */
+	blocks = len / X->vm.blocksize + 2;
+
+	if (X->vm.outsize && blocks > SIZE_MAX / X->vm.outsize)
+		return SIZE_MAX;
+
+	return blocks * X->vm.outsize;
+} /* hxd_outsize() */
+
+
+void hxd_seek(struct hexdump *X, size_t address) {
+	X->vm.i.address = address;
+} /* hxd_seek() */
+
+
+const char *hxd_help(struct hexdump *X) {
+	(void)X;
+	return "helps";
+} /* hxd_help() */
+
+
+/* monotonic clock in nanoseconds, for statistics */
+static unsigned long long hxd_clock(void) {
+#if _WIN32
+	static LARGE_INTEGER hz;
+	LARGE_INTEGER now;
+
+	if (!hz.QuadPart)
+		QueryPerformanceFrequency(&hz);
+
+	QueryPerformanceCounter(&now);
+
+	return (now.QuadPart / hz.QuadPart) * 1000000000ULL
+	     + (now.QuadPart % hz.QuadPart) * 1000000000ULL / hz.QuadPart;
+#else
+	struct timespec ts;
+
+	if (0 != clock_gettime(CLOCK_MONOTONIC, &ts))
+		return 0;
+
+	return ts.tv_sec * 1000000000ULL + ts.tv_nsec;
+#endif
+} /* hxd_clock() */
+
+
+static int hxd_dowrite(struct hexdump *X, const void *src, size_t len) {
+	const unsigned char *p, *pe;
+	size_t n;
+	int error;
+
+	if ((error = vm_enter(&X->vm)))
+		goto error;
+
+	if (X->vm.i.pe == X->vm.i.base)
+		vm_throw(&X->vm, HXD_EOOPS);
+
+	if (X->ir) {
+		rev_write(X, src, len);
+		X->vm.stats.in += len;
+
+		return 0;
+	}
+
+	p = src;
+	pe = p + len;
+
+	while (p < pe) {
+		if (X->vm.i.p == X->vm.i.base && (size_t)(pe - p) >= X->vm.blocksize) {
+			/* format a complete block in place; the VM never writes input */
+			X->stage = X->vm.i.base;
+			X->vm.i.base = (unsigned char *)p;
+			X->vm.i.p = X->vm.i.base;
+			X->vm.i.pe = X->vm.i.base + X->vm.blocksize;
+			X->vm.pc = 0;
+			vm_exec(&X->vm);
+			X->vm.i.base = X->stage;
+			X->vm.i.p = X->vm.i.base;
+			X->vm.i.pe = X->vm.i.base + X->vm.blocksize;
+			X->stage = NULL;
+			X->vm.i.address += X->vm.blocksize;
+			X->vm.stats.blocks++;
+			p += X->vm.blocksize;
+
+			continue;
+		}
+
+		n = MIN(pe - p, X->vm.i.pe - X->vm.i.p);
+		memcpy(X->vm.i.p, p, n);
+		X->vm.i.p += n;
+		p += n;
+
+		if (X->vm.i.p < X->vm.i.pe)
+			break;
+
+		X->vm.i.p = X->vm.i.base;
+		X->vm.pc = 0;
+		vm_exec(&X->vm);
+		X->vm.i.p = X->vm.i.base;
+		X->vm.i.address += X->vm.blocksize;
+		X->vm.stats.blocks++;
+	}
+
+	X->vm.stats.in += len;
+
+	return 0;
+error:
+	if (X->stage) {
+		X->vm.i.base = X->stage;
+		X->vm.i.p = X->vm.i.base;
+		X->vm.i.pe = X->vm.i.base + X->vm.blocksize;
+		X->stage = NULL;
+	}
+
+	return error;
+} /* hxd_dowrite() */
+
+
+int hxd_write(struct hexdump *X, const void *src, size_t len) {
+	unsigned long long begin;
+	int error;
+
+	/* only time calls which complete a block */
+	if (len < (size_t)(X->vm.i.pe - X->vm.i.p))
+		return hxd_dowrite(X, src, len);
+
+	begin = hxd_clock();
+	error = hxd_dowrite(X, src, len);
+	X->vm.stats.exectime += hxd_clock() - begin;
+
+	return error;
+} /* hxd_write() */
+
+
+#if !_WIN32
+int hxd_writev(struct hexdump *X, const struct iovec *iov, int iovcnt) {
+	unsigned long long begin = hxd_clock();
+	int i, error = 0;
+
+	for (i = 0; i < iovcnt && !error; i++)
+		error = hxd_dowrite(X, iov[i].iov_base, iov[i].iov_len);
+
+	X->vm.stats.exectime += hxd_clock() - begin;
+
+	return error;
+} /* hxd_writev() */
+#endif
+
+
+static int hxd_doflush(struct hexdump *X) {
+	unsigned char *pe;
+	int error;
+
+	if ((error = vm_enter(&X->vm)))
+		goto error;
+
+	if (X->ir) {
+		rev_flush(X);
+
+		return 0;
+	}
+
+	if (X->vm.i.p > X->vm.i.base) {
+		pe = X->vm.i.pe;
+		X->vm.i.pe = X->vm.i.p;
+		X->vm.i.p = X->vm.i.base;
+		X->vm.pc = 0;
+		vm_exec(&X->vm);
+		X->vm.i.address += X->vm.i.pe - X->vm.i.base;
+		X->vm.i.p = X->vm.i.base;
+		X->vm.i.pe = pe;
+		X->vm.stats.blocks++;
+	}
+
+	if (X->vm.epilogue && X->vm.i.address && !X->ended) {
+		X->ended = 1;
+
+		pe = X->vm.i.pe;
+		X->vm.i.pe = X->vm.i.base;
+		X->vm.pc = X->vm.epilogue;
+		vm_exec(&X->vm);
+		X->vm.i.pe = pe;
+	}
+
+	return 0;
+error:
+	return error;
+} /* hxd_doflush() */
+
+
+int hxd_flush(struct hexdump *X) {
+	unsigned long long begin = hxd_clock();
+	int error;
+
+	error = hxd_doflush(X);
+	X->vm.stats.exectime += hxd_clock() - begin;
+
+	return error;
+} /* hxd_flush() */
+
+
+/*
+ * Drop the first n octets of pending output, once they're copied out,
+ * count them as delivered, and release memory beyond the retained size
+ * when nothing is left.
+ */
+static void hxd_consume(struct hexdump *X, size_t n) {
+	X->vm.stats.out += n;
+
+	if ((n = (X->vm.o.p - X->vm.o.base) - n)) {
+		memmove(X->vm.o.base, X->vm.o.p - n, n);
+		X->vm.o.p = &X->vm.o.base[n];
+	} else {
+		X->vm.o.p = X->vm.o.base;
+	}
+
+	if (!n && X->retain)
+		hxd_shrink(X, X->retain);
+} /* hxd_consume() */
+
+
+size_t hxd_read(struct hexdump *X, void *dst, size_t lim) {
+	unsigned char *p, *pe, *op;
+	size_t n;
+
+	p = dst;
+	pe = p + lim;
+	op = X->vm.o.base;
+
+	while (p < pe && op < X->vm.o.p) {
+		n = MIN(pe - p, X->vm.o.p - op);
+		memcpy(p, op, n);
+		p += n;
+		op += n;
+	}
+
+	hxd_consume(X, op - X->vm.o.base);
+
+	return p - (unsigned char *)dst;
+} /* hxd_read() */
+
+
+void hxd_stats(struct hexdump *X, struct hxd_stats *stats) {
+	*stats = X->vm.stats;
+} /* hxd_stats() */
+
+
+#if !_WIN32
+
+#define HXD_DUMP_CHUNK  65536          /* input formatted per drain */
+#define HXD_DUMP_WINDOW (1UL << 24)    /* input mapped at once */
+
+/* write pending output directly from the output buffer */
+static int hxd_drain(struct hexdump *X, int fd) {
+	unsigned char *p = X->vm.o.base;
+	ssize_t n;
+	int error = 0;
+
+	/* output formatted into the caller's buffer stays there */
+	if (X->vm.o.borrowed)
+		return 0;
+
+	while (p < X->vm.o.p) {
+		if (-1 == (n = write(fd, p, X->vm.o.p - p))) {
+			if (errno == EINTR)
+				continue;
+
+			error = errno;
+
+			break;
+		}
+
+		p += n;
+	}
+
+	hxd_consume(X, p - X->vm.o.base);
+
+	return error;
+} /* hxd_drain() */
+
+
+static int hxd_dumpspan(struct hexdump *X, const unsigned char *p, size_t len, int out) {
+	size_t n;
+	int error;
+
+	while (len) {
+		n = MIN(len, HXD_DUMP_CHUNK);
+
+		if ((error = hxd_write(X, p, n)) || (error = hxd_drain(X, out)))
+			return error;
+
+		p += n;
+		len -= n;
+	}
+
+	return 0;
+} /* hxd_dumpspan() */
+
+
+/*
+ * Map regular files a window at a time, formatting straight from the page
+ * cache. If the first window cannot be mapped nothing is consumed and 0 is
+ * returned, leaving the caller to fall back to read(2).
+ */
+static int hxd_dumpmap(struct hexdump *X, int in, int out, off_t pos, size_t *len) {
+	long pagesize = sysconf(_SC_PAGESIZE);
+	_Bool mapped = 0;
+	size_t skew, n;
+	void *map;
+	int error;
+
+	if (pagesize <= 0)
+		pagesize = 4096;
+
+	while (*len) {
+		skew = pos % pagesize;
+		n = MIN(*len, HXD_DUMP_WINDOW);
+
+		if (MAP_FAILED == (map = mmap(NULL, skew + n, PROT_READ, MAP_SHARED, in, pos - skew)))
+			return (mapped)? errno : 0;
+
+		mapped = 1;
+
+		posix_madvise(map, skew + n, POSIX_MADV_SEQUENTIAL);
+
+		error = hxd_dumpspan(X, (unsigned char *)map + skew, n, out);
+
+		munmap(map, skew + n);
+
+		if (error)
+			return error;
+
+		pos += n;
+		*len -= n;
+
+		if (-1 == lseek(in, pos, SEEK_SET))
+			return errno;
+	}
+
+	return 0;
+} /* hxd_dumpmap() */
+
+
+int hxd_dump_fd(struct hexdump *X, int in, int out, size_t *off, size_t *len, int opts) {
+	struct stat st;
+	unsigned char *buf = NULL;
+	off_t pos;
+	ssize_t n;
+	int error = 0;
+
+	if (0 != fstat(in, &st))
+		return errno;
+
+	if (S_ISREG(st.st_mode) && -1 != (pos = lseek(in, 0, SEEK_CUR))) {
+		size_t avail = (pos < st.st_size)? (size_t)MIN((uintmax_t)(st.st_size - pos), SIZE_MAX) : 0;
+		size_t skip = MIN(*off, avail);
+
+		pos += skip;
+		*off -= skip;
+		avail -= skip;
+
+		if (-1 == lseek(in, pos, SEEK_SET))
+			return errno;
+
+		if (!(opts & HXD_DUMP_NOMMAP) && avail && *len) {
+			size_t count = MIN(*len, avail);
+			size_t left = count;
+
+			error = hxd_dumpmap(X, in, out, pos, &left);
+			*len -= count - left;
+
+			if (error)
+				return error;
+		}
+	}
+
+	if (!*len && !(opts & HXD_DUMP_FLUSH))
+		return 0;
+
+	if (!(buf = malloc(HXD_DUMP_CHUNK)))
+		return errno;
+
+	while (*off) {
+		if (-1 == (n = read(in, buf, MIN(*off, HXD_DUMP_CHUNK)))) {
+			if (errno == EINTR)
+				continue;
+
+			error = errno;
+
+			goto exit;
+		} else if (!n) {
+			goto exit;
+		}
+
+		*off -= n;
+	}
+
+	while (*len) {
+		if (-1 == (n = read(in, buf, MIN(*len, HXD_DUMP_CHUNK)))) {
+			if (errno == EINTR)
+				continue;
+
+			error = errno;
+
+			goto exit;
+		} else if (!n) {
+			break;
+		}
+
+		*len -= n;
+
+		if ((error = hxd_dumpspan(X, buf, n, out)))
+			goto exit;
+	}
+
+	if (opts & HXD_DUMP_FLUSH) {
+		if ((error = hxd_flush(X)) || (error = hxd_drain(X, out)))
+			goto exit;
+	}
+exit:
+	free(buf);
+
+	return error;
+} /* hxd_dump_fd() */
+
+#endif /* !_WIN32 */
+
+
+const char *hxd_strerror(int error) {
+	static const char *txt[] = {
+		[HXD_EFORMAT - HXD_EBASE] = "invalid format",
+		[HXD_EDRAINED - HXD_EBASE] = "unit drains buffer",
+		[HXD_ENOTSUPP - HXD_EBASE] = "unsupported conversion sequence",
+		[HXD_EOOPS - HXD_EBASE] = "machine traps",
+		[HXD_EIMAGE - HXD_EBASE] = "stale or corrupt program image",
+	};
+
+	if (error >= 0)
+		return strerror(error);
+
+	if (error >= HXD_EBASE && error < HXD_ELAST) {
+		error -= HXD_EBASE;
+
+		if (error < (int)countof(txt) && txt[error])
+			return txt[error];
+	}
+
+	return "unknown error (hexdump)";
+} /* hxd_strerror() */
+
+
+int hxd_version(void) {
+	return HXD_VERSION;
+} /* hxd_version() */
+
+
+const char *hxd_vendor(void) {
+	return HXD_VENDOR;
+} /* hxd_vendor() */
+
+
+int hxd_v_rel(void) {
+	return HXD_V_REL;
+} /* hxd_v_rel() */
+
+
+int hxd_v_abi(void) {
+	return HXD_V_ABI;
+} /* hxd_v_abi() */
+
+
+int hxd_v_api(void) {
+	return HXD_V_API;
+} /* hxd_v_api() */
+
+
+#if HEXDUMP_LUALIB
+
+#include <lua.h>
+#include <lauxlib.h>
+
+#ifndef _WIN32
+#include <unistd.h> /* ssize_t read(2) */
+#endif
+
+#if WITH_LUA_VERSION_NUM && WITH_LUA_VERSION_NUM != LUA_VERSION_NUM
+#error Lua headers do not implement expected API
+#endif
+
+#define HEXDUMP_CLASS "HEXDUMP*"
+
+
+struct hxdL_context {
+	struct hexdump *X;
+
+	/* while cached: neighbours in LRU order, and the cache key */
+	struct hxdL_context *prev, *next;
+	int fmt; /* registry reference to the format string */
+	int flags;
+}; /* struct hxdL_context */
+
+
+static inline struct hexdump *hxdL_checkudata(lua_State *L, int index) {
+	return ((struct hxdL_context *)luaL_checkudata(L, index, HEXDUMP_CLASS))->X;
+} /* hxdL_checkudata() */
+
+
+static struct hexdump *hxdL_push(lua_State *L) {
+	struct hxdL_context *C;
+	int error;
+
+	C = lua_newuserdata(L, sizeof *C);
+	C->X = NULL;
+	C->prev = NULL;
+	C->next = NULL;
+	C->fmt = LUA_NOREF;
+	C->flags = 0;
+
+	luaL_getmetatable(L, HEXDUMP_CLASS);
+	lua_setmetatable(L, -2);
+
+	if (!(C->X = hxd_open(&error)))
+		luaL_error(L, "hexdump: %s", hxd_strerror(error));
+
+	return C->X;
+} /* hxdL_push() */
+
+
+/*
+ * Push the entire output buffer as a single string and empty it. This
+ * copies the formatted output exactly once, unlike draining through a
+ * luaL_Buffer in LUAL_BUFFERSIZE pieces.
+ */
+static void hxdL_pushoutput(lua_State *L, struct hexdump *X) {
+	size_t n = X->vm.o.p - X->vm.o.base;
+
+	lua_pushlstring(L, (n)? (const char *)X->vm.o.base : "", n);
+
+	hxd_consume(X, n);
+} /* hxdL_pushoutput() */
+
+
+/*
+ * Format a string of any length with one pass over the input. The first
+ * block is formatted separately to learn the size of a block's output, so
+ * the output buffer can be grown once rather than doubled repeatedly. The
+ * compiled bound, vm.outsize, would overshoot: it covers the widest value
+ * of every conversion, many times what %f or JSON escaping usually print.
+ */
+static int hxdL_format(struct hexdump *X, const char *p, size_t n) {
+	size_t bs = hxd_blocksize(X), size, blocks;
+	int error;
+
+	if (bs && n > bs) {
+		size = X->vm.o.p - X->vm.o.base;
+
+		if ((error = hxd_write(X, p, bs)))
+			return error;
+
+		p += bs;
+		n -= bs;
+
+		size = (X->vm.o.p - X->vm.o.base) - size;
+		blocks = (n / bs) + 1;
+
+		if (size && blocks <= (size_t)-1 / size) {
+			if ((error = hxd_reserve(X, size * blocks)))
+				return error;
+		}
+	}
+
+	return hxd_write(X, p, n);
+} /* hxdL_format() */
+
+
+/*
+ * The memoized contexts of .apply and .lines are kept in a table mapping
+ * format strings to tables mapping flags to contexts. Only idle contexts
+ * are kept, and at most capacity of them; when full the least recently
+ * used context is dropped from the table and left to the garbage
+ * collector, which won't reclaim it while an iterator still holds it.
+ * Cached contexts are also threaded on a list, most recently used first,
+ * so finding the one to drop doesn't mean walking the table.
+ */
+#define HXDL_CACHESIZE 64   /* default capacity of the context cache */
+#define HXDL_IDLESIZE  4096 /* output buffer retained by a cached context */
+
+struct hxdL_cache {
+	unsigned long count, capacity;
+	struct hxdL_context *head, *tail;
+	unsigned long hits, misses, evictions;
+}; /* struct hxdL_cache */
+
+
+static void hxdL_link(struct hxdL_cache *C, struct hxdL_context *ctx) {
+	ctx->prev = NULL;
+	ctx->next = C->head;
+
+	if (C->head)
+		C->head->prev = ctx;
+	else
+		C->tail = ctx;
+
+	C->head = ctx;
+} /* hxdL_link() */
+
+
+static void hxdL_unlink(struct hxdL_cache *C, struct hxdL_context *ctx) {
+	if (ctx->prev)
+		ctx->prev->next = ctx->next;
+	else
+		C->head = ctx->next;
+
+	if (ctx->next)
+		ctx->next->prev = ctx->prev;
+	else
+		C->tail = ctx->prev;
+
+	ctx->prev = NULL;
+	ctx->next = NULL;
+} /* hxdL_unlink() */
+
+
+static void hxdL_remove(lua_State *L, int cache, int fmt, lua_Integer flags) {
+	lua_pushvalue(L, fmt);
+	lua_rawget(L, cache);
+
+	if (!lua_isnil(L, -1)) {
+		lua_pushnil(L);
+		lua_rawseti(L, -2, flags);
+
+		/* drop empty tables so dynamic formats don't accumulate keys */
+		lua_pushnil(L);
+
+		if (lua_next(L, -2)) {
+			lua_pop(L, 2);
+		} else {
+			lua_pushvalue(L, fmt);
+			lua_pushnil(L);
+			lua_rawset(L, cache);
+		}
+	}
+
+	lua_pop(L, 1);
+} /* hxdL_remove() */
+
+
+static void hxdL_evict(lua_State *L, int cache, struct hxdL_cache *C) {
+	struct hxdL_context *lru = C->tail;
+	int fmt, flags;
+
+	if (!lru)
+		return /* void */;
+
+	/* unlink first; once out of the table the collector may free it */
+	fmt = lru->fmt;
+	flags = lru->flags;
+	hxdL_unlink(C, lru);
+	lru->fmt = LUA_NOREF;
+
+	lua_rawgeti(L, LUA_REGISTRYINDEX, fmt);
+	hxdL_remove(L, cache, lua_gettop(L), flags);
+	lua_pop(L, 1);
+	luaL_unref(L, LUA_REGISTRYINDEX, fmt);
+
+	C->count--;
+	C->evictions++;
+} /* hxdL_evict() */
+
+
+/*
+ * Push the memoized context for the format at stack index fmt, compiling
+ * a new context if none is cached. The context is removed from the cache
+ * while in use so that nested or interleaved callers (e.g. an apply call
+ * inside a .lines loop) never share a context. Return it with
+ * hxdL_release(). All stack indices must be absolute or pseudo-indices.
+ */
+static struct hexdump *hxdL_acquire(lua_State *L, int cache, struct hxdL_cache *C, int fmt, int flags) {
+	struct hexdump *X;
+	int error;
+
+	lua_pushvalue(L, fmt);
+	lua_rawget(L, cache);
+
+	if (!lua_isnil(L, -1)) {
+		lua_rawgeti(L, -1, flags);
+		lua_replace(L, -2);
+	}
+
+	if (!lua_isnil(L, -1)) {
+		struct hxdL_context *ctx = luaL_checkudata(L, -1, HEXDUMP_CLASS);
+
+		hxdL_unlink(C, ctx);
+		luaL_unref(L, LUA_REGISTRYINDEX, ctx->fmt);
+		ctx->fmt = LUA_NOREF;
+
+		hxdL_remove(L, cache, fmt, flags);
+		C->count--;
+		C->hits++;
+
+		return ctx->X;
+	}
+
+	lua_pop(L, 1);
+
+	C->misses++;
+
+	X = hxdL_push(L);
+
+	if ((error = hxd_compile(X, luaL_checkstring(L, fmt), flags)))
+		luaL_error(L, "hexdump: %s", hxd_strerror(error));
+
+	return X;
+} /* hxdL_acquire() */
+
+
+static void hxdL_release(lua_State *L, int cache, struct hxdL_cache *C, int fmt, int flags, int index) {
+	struct hxdL_context *ctx = luaL_checkudata(L, index, HEXDUMP_CLASS);
+
+	if (!C->capacity)
+		return /* void */;
+
+	hxd_shrink(ctx->X, HXDL_IDLESIZE);
+
+	lua_pushvalue(L, fmt);
+	ctx->fmt = luaL_ref(L, LUA_REGISTRYINDEX);
+	ctx->flags = flags;
+
+	lua_pushvalue(L, fmt);
+	lua_rawget(L, cache);
+
+	if (lua_isnil(L, -1)) {
+		lua_pop(L, 1);
+
+		lua_newtable(L);
+
+		lua_pushvalue(L, fmt);
+		lua_pushvalue(L, -2);
+		lua_rawset(L, cache);
+	}
+
+	lua_rawgeti(L, -1, flags);
+
+	if (lua_isnil(L, -1)) {
+		C->count++;
+	} else {
+		/* an interleaved caller compiled the same format; replace it */
+		struct hxdL_context *old = lua_touserdata(L, -1);
+
+		hxdL_unlink(C, old);
+		luaL_unref(L, LUA_REGISTRYINDEX, old->fmt);
+		old->fmt = LUA_NOREF;
+	}
+
+	lua_pushvalue(L, index);
+	lua_rawseti(L, -3, flags);
+	hxdL_link(C, ctx);
+
+	lua_pop(L, 2);
+
+	while (C->count > C->capacity)
+		hxdL_evict(L, cache, C);
+} /* hxdL_release() */
+
+
+static int hxdL_cache(lua_State *L) {
+	struct hxdL_cache *C = lua_touserdata(L, lua_upvalueindex(2));
+
+	if (!lua_isnoneornil(L, 1)) {
+		lua_Integer capacity = luaL_checkinteger(L, 1);
+
+		luaL_argcheck(L, capacity >= 0, 1, "negative capacity");
+
+		C->capacity = capacity;
+
+		while (C->count > C->capacity)
+			hxdL_evict(L, lua_upvalueindex(1), C);
+	}
+
+	lua_newtable(L);
+
+	lua_pushnumber(L, C->capacity);
+	lua_setfield(L, -2, "capacity");
+	lua_pushnumber(L, C->count);
+	lua_setfield(L, -2, "count");
+	lua_pushnumber(L, C->hits);
+	lua_setfield(L, -2, "hits");
+	lua_pushnumber(L, C->misses);
+	lua_setfield(L, -2, "misses");
+	lua_pushnumber(L, C->evictions);
+	lua_setfield(L, -2, "evictions");
+
+	return 1;
+} /* hxdL_cache() */
+
+
+static int hxdL_apply(lua_State *L) {
+	struct hxdL_cache *C = lua_touserdata(L, lua_upvalueindex(2));
+	const char *p;
+	size_t n;
+	struct hexdump *X;
+	int top = lua_gettop(L), data = 2, flags = 0;
+	int error;
+
+	luaL_checkstring(L, 1);
+
+	if (lua_type(L, 2) == LUA_TNUMBER) {
+		flags = lua_tointeger(L, 2);
+		data = 3;
+	}
+
+	X = hxdL_acquire(L, lua_upvalueindex(1), C, 1, flags);
+
+	hxd_reset(X);
+
+	for (; data <= top; data++) {
+		p = luaL_checklstring(L, data, &n);
+
+		if ((error = hxdL_format(X, p, n)))
+			goto error;
+	}
+
+	if ((error = hxd_flush(X)))
+		goto error;
+
+	hxdL_pushoutput(L, X);
+	hxdL_release(L, lua_upvalueindex(1), C, 1, flags, top + 1);
+
+	return 1;
+error:
+	return luaL_error(L, "hexdump: %s", hxd_strerror(error));
+} /* hxdL_apply() */
+
+
+/* FILE of a Lua file handle, which must be open */
+static FILE *hxdL_checkfile(lua_State *L, int file) {
+#if LUA_VERSION_NUM >= 502
+	/* Lua 5.2 and later leave f set on close but clear closef */
+	luaL_Stream *fh = luaL_checkudata(L, file, LUA_FILEHANDLE);
+
+	if (!fh->closef)
+		luaL_error(L, "hexdump: attempt to use a closed file");
+
+	return fh->f;
+#else
+	FILE **fh = luaL_checkudata(L, file, LUA_FILEHANDLE);
+
+	if (!*fh)
+		luaL_error(L, "hexdump: attempt to use a closed file");
+
+	return *fh;
+#endif
+} /* hxdL_checkfile() */
+
+
+/*
+ * Read up to lim bytes from a Lua file handle or an integer file
+ * descriptor. Returns 0 on EOF.
+ */
+static size_t hxdL_fill(lua_State *L, int file, void *dst, size_t lim) {
+	size_t n;
+
+	if (lua_type(L, file) == LUA_TNUMBER) {
+#ifndef _WIN32
+		int fd = lua_tointeger(L, file);
+		ssize_t count;
+
+		while (-1 == (count = read(fd, dst, lim))) {
+			if (errno != EINTR)
+				luaL_error(L, "hexdump: %s", hxd_strerror(errno));
+		}
+
+		return count;
+#else
+		luaL_error(L, "hexdump: file descriptors not supported");
+#endif
+	} else {
+		FILE *fp = hxdL_checkfile(L, file);
+
+		n = fread(dst, 1, lim, fp);
+
+		if (!n && ferror(fp))
+			luaL_error(L, "hexdump: %s", hxd_strerror(errno));
+
+		return n;
+	}
+
+	return 0;
+} /* hxdL_fill() */
+
+
+#define HXDL_STREAMSIZE 65536 /* output accumulated per iteration */
+
+/*
+ * Iterator returned by .lines and :stream. Upvalues are the context (or
+ * false once exhausted), the file, and for .lines the cache, cache state,
+ * format and flags used to return the context to the cache at EOF.
+ */
+static int hxdL_next(lua_State *L) {
+	struct hexdump *X;
+	char buf[LUAL_BUFFERSIZE];
+	size_t n;
+	int error;
+
+	if (!lua_toboolean(L, lua_upvalueindex(1)))
+		return 0;
+
+	X = hxdL_checkudata(L, lua_upvalueindex(1));
+
+	while ((size_t)(X->vm.o.p - X->vm.o.base) < HXDL_STREAMSIZE) {
+		if (!(n = hxdL_fill(L, lua_upvalueindex(2), buf, sizeof buf))) {
+			if ((error = hxd_flush(X)))
+				goto error;
+
+			n = X->vm.o.p - X->vm.o.base;
+			hxdL_pushoutput(L, X);
+
+			if (!lua_isnil(L, lua_upvalueindex(3))) {
+				struct hxdL_cache *C = lua_touserdata(L, lua_upvalueindex(4));
+				int flags = lua_tointeger(L, lua_upvalueindex(6));
+
+				hxdL_release(L, lua_upvalueindex(3), C, lua_upvalueindex(5), flags, lua_upvalueindex(1));
+			}
+
+			lua_pushboolean(L, 0);
+			lua_replace(L, lua_upvalueindex(1));
+
+			return (n)? 1 : 0;
+		}
+
+		if ((error = hxd_write(X, buf, n)))
+			goto error;
+	}
+
+	hxdL_pushoutput(L, X);
+
+	return 1;
+error:
+	return luaL_error(L, "hexdump: %s", hxd_strerror(error));
+} /* hxdL_next() */
+
+
+static int hxdL_lines(lua_State *L) {
+	struct hxdL_cache *C = lua_touserdata(L, lua_upvalueindex(2));
+	int file = 2, flags = 0;
+
+	luaL_checkstring(L, 1);
+
+	if (lua_type(L, 2) == LUA_TNUMBER && !lua_isnoneornil(L, 3)) {
+		flags = lua_tointeger(L, 2);
+		file = 3;
+	}
+
+	luaL_checkany(L, file);
+	lua_settop(L, file);
+
+	hxd_reset(hxdL_acquire(L, lua_upvalueindex(1), C, 1, flags));
+	lua_pushvalue(L, file);
+	lua_pushvalue(L, lua_upvalueindex(1));
+	lua_pushvalue(L, lua_upvalueindex(2));
+	lua_pushvalue(L, 1);
+	lua_pushinteger(L, flags);
+	lua_pushcclosure(L, &hxdL_next, 6);
+
+	return 1;
+} /* hxdL_lines() */
+
+
+static int hxdL__call(lua_State *L) {
+	lua_pushvalue(L, lua_upvalueindex(1));
+	lua_replace(L, 1);
+
+	lua_call(L, lua_gettop(L) - 1, 1);
+
+	return 1;
+} /* hxdL__call() */
+
+
+static int hxdL_new(lua_State *L) {
+	hxdL_push(L);
+
+	return 1;
+} /* hxdL_new() */
+
+
+static int hxdL_compile(lua_State *L) {
+	struct hexdump *X = hxdL_checkudata(L, 1);
+	const char *fmt = luaL_checkstring(L, 2);
+	int flags = (int)luaL_optinteger(L, 3, 0);
+	int error;
+
+	if ((error = hxd_compile(X, fmt, flags)))
+		return luaL_error(L, "hexdump: %s", hxd_strerror(error));
+
+	lua_pushboolean(L, 1);
+
+	return 1;
+} /* hxdL_compile() */
+
+
+static int hxdL_save(lua_State *L) {
+	struct hexdump *X = hxdL_checkudata(L, 1);
+	unsigned char img[IMG_HDRSIZE + sizeof X->vm.code + IMG_SUMSIZE];
+	size_t n;
+
+	if (!(n = hxd_save(X, img, sizeof img)))
+		return luaL_error(L, "hexdump: %s", hxd_strerror(HXD_ENOTSUPP));
+
+	lua_pushlstring(L, (char *)img, n);
+
+	return 1;
+} /* hxdL_save() */
+
+
+static int hxdL_load(lua_State *L) {
+	struct hexdump *X = hxdL_checkudata(L, 1);
+	const char *img;
+	size_t n;
+	int error;
+
+	img = luaL_checklstring(L, 2, &n);
+
+	if ((error = hxd_load(X, img, n)))
+		return luaL_error(L, "hexdump: %s", hxd_strerror(error));
+
+	lua_pushboolean(L, 1);
+
+	return 1;
+} /* hxdL_load() */
+
+
+static int hxdL_blocksize(lua_State *L) {
+	struct hexdump *X = hxdL_checkudata(L, 1);
+
+	lua_pushnumber(L, hxd_blocksize(X));
+
+	return 1;
+} /* hxdL_blocksize() */
+
+
+static int hxdL_seek(lua_State *L) {
+	struct hexdump *X = hxdL_checkudata(L, 1);
+
+	hxd_seek(X, (size_t)luaL_checkinteger(L, 2));
+
+	lua_pushboolean(L, 1);
+
+	return 1;
+} /* hxdL_seek() */
+
+
+static int hxdL_write(lua_State *L) {
+	struct hexdump *X = hxdL_checkudata(L, 1);
+	const char *data;
+	size_t size;
+	int error;
+
+	data = luaL_checklstring(L, 2, &size);
+
+	if ((error = hxd_write(X, data, size)))
+		return luaL_error(L, "hexdump: %s", hxd_strerror(error));
+
+	lua_pushboolean(L, 1);
+
+	return 1;
+} /* hxdL_write() */
+
+
+static int hxdL_flush(lua_State *L) {
+	struct hexdump *X = hxdL_checkudata(L, 1);
+	int error;
+
+	if ((error = hxd_flush(X)))
+		return luaL_error(L, "hexdump: %s", hxd_strerror(error));
+
+	lua_pushboolean(L, 1);
+
+	return 1;
+} /* hxdL_flush() */
+
+
+static int hxdL_read(lua_State *L) {
+	struct hexdump *X = hxdL_checkudata(L, 1);
+
+	hxdL_pushoutput(L, X);
+
+	return 1;
+} /* hxdL_read() */
+
+
+static int hxdL_trim(lua_State *L) {
+	struct hexdump *X = hxdL_checkudata(L, 1);
+
+	hxd_trim(X);
+
+	lua_pushboolean(L, 1);
+
+	return 1;
+} /* hxdL_trim() */
+
+
+static int hxdL_retain(lua_State *L) {
+	struct hexdump *X = hxdL_checkudata(L, 1);
+	lua_Integer lim = luaL_checkinteger(L, 2);
+
+	luaL_argcheck(L, lim >= 0, 2, "negative size");
+
+	hxd_retain(X, lim);
+
+	lua_pushboolean(L, 1);
+
+	return 1;
+} /* hxdL_retain() */
+
+
+static int hxdL_stats(lua_State *L) {
+	struct hexdump *X = hxdL_checkudata(L, 1);
+	struct hxd_stats stats;
+
+	hxd_stats(X, &stats);
+
+	lua_newtable(L);
+
+	lua_pushnumber(L, stats.in);
+	lua_setfield(L, -2, "in");
+	lua_pushnumber(L, stats.out);
+	lua_setfield(L, -2, "out");
+	lua_pushnumber(L, stats.blocks);
+	lua_setfield(L, -2, "blocks");
+	lua_pushnumber(L, stats.reallocs);
+	lua_setfield(L, -2, "reallocs");
+	lua_pushnumber(L, stats.peak);
+	lua_setfield(L, -2, "peak");
+	lua_pushnumber(L, stats.exectime / 1e9);
+	lua_setfield(L, -2, "exectime");
+
+	return 1;
+} /* hxdL_stats() */
+
+
+/* descriptor of a Lua file handle or integer file descriptor */
+static int hxdL_tofd(lua_State *L, int file) {
+	FILE *fp;
+
+	if (lua_type(L, file) == LUA_TNUMBER)
+		return lua_tointeger(L, file);
+
+	fp = hxdL_checkfile(L, file);
+	fflush(fp);
+
+	return fileno(fp);
+} /* hxdL_tofd() */
+
+
+static int hxdL_dump(lua_State *L) {
+#ifndef _WIN32
+	struct hexdump *X = hxdL_checkudata(L, 1);
+	int in = hxdL_tofd(L, 2);
+	int out = hxdL_tofd(L, 3);
+	lua_Integer offset = luaL_optinteger(L, 4, 0);
+	size_t off, len, max;
+	int error;
+
+	luaL_argcheck(L, offset >= 0, 4, "negative offset");
+	off = offset;
+	len = max = (lua_isnoneornil(L, 5))? (size_t)-1 : (size_t)luaL_checkinteger(L, 5);
+
+	if ((error = hxd_dump_fd(X, in, out, &off, &len, HXD_DUMP_FLUSH)))
+		return luaL_error(L, "hexdump: %s", hxd_strerror(error));
+
+	lua_pushnumber(L, max - len);
+
+	return 1;
+#else
+	return luaL_error(L, "hexdump: file descriptors not supported");
+#endif
+} /* hxdL_dump() */
+
+
+static int hxdL_stream(lua_State *L) {
+	hxdL_checkudata(L, 1);
+	luaL_checkany(L, 2);
+	lua_settop(L, 2);
+
+	lua_pushnil(L);
+	lua_pushcclosure(L, &hxdL_next, 3);
+
+	return 1;
+} /* hxdL_stream() */
+
+
+static int hxdL__gc(lua_State *L) {
+	struct hxdL_context *C = luaL_checkudata(L, 1, HEXDUMP_CLASS);
+
+	hxd_close(C->X);
+	C->X = NULL;
+
+	return 0;
+} /* hxdL__gc() */
+
+
+static const luaL_Reg hxdL_methods[] = {
+	{ "compile",   &hxdL_compile },
+	{ "save",      &hxdL_save },
+	{ "load",      &hxdL_load },
+	{ "blocksize", &hxdL_blocksize },
+	{ "seek",      &hxdL_seek },
+	{ "write",     &hxdL_write },
+	{ "flush",     &hxdL_flush },
+	{ "read",      &hxdL_read },
+	{ "trim",      &hxdL_trim },
+	{ "retain",    &hxdL_retain },
+	{ "stats",     &hxdL_stats },
+	{ "stream",    &hxdL_stream },
+	{ "dump",      &hxdL_dump },
+	{ NULL,        NULL },
+}; /* hxdL_methods[] */
+
+
+static const luaL_Reg hxdL_metatable[] = {
+	{ "__gc",  &hxdL__gc },
+	{ NULL,    NULL },
+}; /* hxdL_metatable[] */
+
+
+static const luaL_Reg hxdL_globals[] = {
+	{ "new",  &hxdL_new },
+	{ NULL,   NULL },
+}; /* hxdL_globals[] */
+
+
+static void hxdL_register(lua_State *L, const luaL_Reg *l) {
+#if LUA_VERSION_NUM >= 502
+	luaL_setfuncs(L, l, 0);
+#else
+	luaL_register(L, NULL, l);
+#endif
+} /* hxdL_register() */
+
+
+int luaopen_hexdump(lua_State *L) {
+	static const struct { const char *k; int v; } macro[] = {
+		{ "NATIVE",        HXD_NATIVE },
+		{ "NETWORK",       HXD_NETWORK },
+		{ "BIG_ENDIAN",    HXD_BIG_ENDIAN },
+		{ "LITTLE_ENDIAN", HXD_LITTLE_ENDIAN },
+		{ "NOPADDING",     HXD_NOPADDING },
+		{ "REVERSE",       HXD_REVERSE },
+		{ "COLOR",         HXD_COLOR },
+		{ "JSON",          HXD_JSON },
+	};
+	static const struct { const char *k; const char *v; } predef[] = {
+		{ "b", HEXDUMP_b },
+		{ "c", HEXDUMP_c },
+		{ "C", HEXDUMP_C },
+		{ "d", HEXDUMP_d },
+		{ "o", HEXDUMP_o },
+		{ "x", HEXDUMP_x },
+		{ "i", HEXDUMP_i },
+		{ "J", HEXDUMP_J },
+	};
+	struct hxdL_cache *C;
+	unsigned i;
+
+	if (luaL_newmetatable(L, HEXDUMP_CLASS)) {
+		hxdL_register(L, hxdL_metatable);
+		lua_newtable(L);
+		hxdL_register(L, hxdL_methods);
+		lua_setfield(L, -2, "__index");
+	}
+
+	lua_pop(L, 1);
+
+	lua_newtable(L);
+	hxdL_register(L, hxdL_globals);
+
+	lua_newtable(L); /* cache of compiled formats */
+	C = lua_newuserdata(L, sizeof *C);
+	memset(C, 0, sizeof *C);
+	C->capacity = HXDL_CACHESIZE;
+
+	lua_pushvalue(L, -2);
+	lua_pushvalue(L, -2);
+	lua_pushcclosure(L, &hxdL_lines, 2);
+	lua_setfield(L, -4, "lines");
+	lua_pushvalue(L, -2);
+	lua_pushvalue(L, -2);
+	lua_pushcclosure(L, &hxdL_cache, 2);
+	lua_setfield(L, -4, "cache");
+	lua_pushcclosure(L, &hxdL_apply, 2);
+
+	lua_newtable(L); /* metatable of our global table */
+	lua_pushvalue(L, -2);
+	lua_pushcclosure(L, &hxdL__call, 1);
+	lua_setfield(L, -2, "__call");
+	lua_setmetatable(L, -3);
+
+	lua_setfield(L, -2, "apply"); /* global.apply */
+
+	for (i = 0; i < countof(macro); i++) {
+		lua_pushinteger(L, macro[i].v);
+		lua_setfield(L, -2, macro[i].k);
+	}
+
+	for (i = 0; i < countof(predef); i++) {
+		lua_pushstring(L, predef[i].v);
+		lua_setfield(L, -2, predef[i].k);
+	}
+
+	lua_pushinteger(L, HXD_VERSION);
+	lua_setfield(L, -2, "VERSION");
+
+	lua_pushstring(L, HXD_VENDOR);
+	lua_setfield(L, -2, "VENDOR");
+
+	return 1;
+} /* luaopen_hexdump() */
+
+#else
+
+int luaopen_hexdump() {
+	abort();
+} /* luaopen_hexdump() */
+
+#endif /* HEXDUMP_LUALIB */
+
+
+#if HEXDUMP_MAIN
+
+#include <ctype.h>  /* isspace(3) */
+#include <errno.h>  /* ERANGE */
+#include <limits.h> /* LONG_MAX ULONG_MAX */
+#include <stdlib.h> /* strtoul(3) */
+#include <stdio.h>  /* FILE SEEK_SET stdout stderr stdin fprintf(3) fseek(3) */
+#include <string.h> /* strcmp(3) */
+
+#ifdef _WIN32
+#include <fcntl.h>  /* _fcntl(3) _setmode(3) _O_BINARY */
+#include <process.h> /* _getpid(3) */
+#include <io.h>     /* _isatty(3) */
+#define getpid _getpid
+#define isatty _isatty
+#define STDOUT_FILENO 1
+#else
+#include <fcntl.h>    /* O_RDWR open(2) */
+#include <sys/mman.h> /* mmap(2) munmap(2) */
+#include <sys/stat.h> /* struct stat fstat(2) stat(2) S_ISREG */
+#include <unistd.h>   /* STDOUT_FILENO ftruncate(2) getuid(2) isatty(3) */
+#endif
+
+#ifndef HAVE_ERR
+#define HAVE_ERR (!_WIN32)
+#endif
+
+#ifndef HAVE_GETOPT
+#define HAVE_GETOPT (!_WIN32)
+#endif
+
+#ifndef HAVE_PTHREAD
+#define HAVE_PTHREAD (!_WIN32)
+#endif
+
+#if HAVE_PTHREAD
+#include <pthread.h> /* pthread_create(3) pthread_join(3) pthread_mutex_lock(3) pthread_cond_wait(3) */
+#include <sys/stat.h> /* struct stat fstat(2) stat(2) S_ISREG */
+#include <fcntl.h>   /* O_RDONLY open(2) */
+#include <unistd.h>  /* lseek(2) pread(2) read(2) write(2) close(2) */
+#endif
+
+#if HAVE_ERR
+#include <err.h>    /* err(3) errx(3) */
+#else
+#include <stdarg.h> /* va_list va_start va_end */
+
+static void warn(const char *fmt, ...) {
+	int error = errno;
+	va_list ap;
+	va_start(ap, fmt);
+	fputs("hexdump: ", stderr);
+	vfprintf(stderr, fmt, ap);
+	fprintf(stderr, ": %s\n", strerror(error));
+	va_end(ap);
+}
+
+static void warnx(const char *fmt, ...) {
+	va_list ap;
+	va_start(ap, fmt);
+	fputs("hexdump: ", stderr);
+	vfprintf(stderr, fmt, ap);
+	fputc('\n', stderr);
+	va_end(ap);
+}
+
+#define err(status, ...) (warn(__VA_ARGS__), exit((status)))
+#define errx(status, ...) (warnx(__VA_ARGS__), exit((status)))
+
+#endif /* HAVE_ERR */
+
+#if HAVE_GETOPT
+#include <unistd.h> /* getopt(3) */
+#else
+char *optarg;
+int opterr = 1, optind = 1, optopt;
+
+#define ENTER                                                           \
+	do {                                                            \
+	static const int pc0 = __LINE__;                                \
+	switch (pc0 + pc) {                                             \
+	case __LINE__: (void)0
+
+#define SAVE_AND_DO(do_statement)                                       \
+	do {                                                            \
+		pc = __LINE__ - pc0;                                    \
+		do_statement;                                           \
+		case __LINE__: (void)0;                                 \
+	} while (0)
+
+#define YIELD(rv)                                                       \
+	SAVE_AND_DO(return (rv))
+
+#define LEAVE                                                           \
+	SAVE_AND_DO(break);                                             \
+	}                                                               \
+	} while (0)
+
+int getopt(int argc, char *const argv[], const char *shortopts) {
+	static unsigned pc;
+	static char *cp;
+
+	optopt = 0;
+	optarg = NULL;
+
+	ENTER;
+
+	while (optind < argc) {
+		cp = argv[optind];
+
+		if (*cp != '-' || !strcmp(cp, "-")) {
+			break;
+		} else if (!strcmp(cp, "--")) {
+			optind++;
+			break;
+		}
+
+		for (;;) {
+			char *shortopt;
+
+			if (!(optopt = *++cp)) {
+				optind++;
+				break;
+			} else if (!(shortopt = strchr(shortopts, optopt))) {
+				if (*shortopts != ':' && opterr)
+					warnx("illegal option -- %c", optopt);
+				YIELD('?');
+			} else if (shortopt[1] != ':') {
+				YIELD(optopt);
+			} else if (cp[1]) {
+				optarg = &cp[1];
+				optind++;
+				YIELD(optopt);
+				break;
+			} else if (optind + 1 < argc) {
+				optarg = argv[optind + 1];
+				optind += 2;
+				YIELD(optopt);
+				break;
+			} else {
+				if (*shortopts != ':' && opterr)
+					warnx("option requires an argument -- %c", optopt);
+				optind++;
+				YIELD((*shortopts == ':')? ':' : '?');
+				break;
+			}
+		}
+	}
+
+	LEAVE;
+
+	return -1;
+}
+#endif /* HAVE_GETOPT */
+
+
+static void run(struct hexdump *X, FILE *fp, _Bool flush, size_t *off, size_t *max) {
+#if !_WIN32
+	int error;
+
+	/* TODO: need to update the dump address after skipping */
+	fflush(stdout);
+
+	if ((error = hxd_dump_fd(X, fileno(fp), STDOUT_FILENO, off, max, (flush)? HXD_DUMP_FLUSH : 0)))
+		errx(EXIT_FAILURE, "%s", hxd_strerror(error));
+#else
+	char buf[256];
+	size_t len;
+	int error;
+
+	/* TODO: need to update the dump address after skipping */
+	if (*off) {
+		long n = MIN(LONG_MAX, *off);
+		if (0 == fseek(fp, n, SEEK_SET))
+			*off -= n;
+		while (*off && (len = fread(buf, 1, MIN(sizeof buf, *off), fp)))
+			*off -= len;
+	}
+
+	while (*max && (len = fread(buf, 1, MIN(sizeof buf, *max), fp))) {
+		*max -= len;
+		if ((error = hxd_write(X, buf, len)))
+			errx(EXIT_FAILURE, "%s", hxd_strerror(error));
+
+		while ((len = hxd_read(X, buf, sizeof buf)))
+			fwrite(buf, 1, len, stdout);
+	}
+
+	if (flush) {
+		if ((error = hxd_flush(X)))
+			errx(EXIT_FAILURE, "%s", hxd_strerror(error));
+
+		while ((len = hxd_read(X, buf, sizeof buf)))
+			fwrite(buf, 1, len, stdout);
+	}
+#endif
+} /* run() */
+
+
+/*
+ * Output file mode (-w). The file replaces standard output, and when the
+ * input is only regular files, so its size is known, and it's formatted
+ * by run(), the file is extended to the bound hxd_outsize() gives for it,
+ * mapped, and formatted into directly with hxd_setout(): no write(2)s and
+ * no output buffer. It's truncated to the length written at the end, or
+ * at exit if an error cuts the dump short.
+ */
+static struct {
+	const char *path;
+	int fd;
+	void *map;
+	size_t size;
+	struct hexdump *X; /* formatting into map */
+} output = { .fd = -1 };
+
+
+static void output_close(void) {
+#if !_WIN32
+	size_t n;
+
+	if (output.map) {
+		n = hxd_setout(output.X, NULL, 0);
+		munmap(output.map, output.size);
+		output.map = NULL;
+
+		if (0 != ftruncate(output.fd, n))
+			err(EXIT_FAILURE, "%s", output.path);
+	}
+
+	if (output.fd != -1) {
+		close(output.fd);
+		output.fd = -1;
+	}
+#endif
+} /* output_close() */
+
+
+/* at exit, if an error cut the dump short, keep only what was formatted */
+static void output_abort(void) {
+#if !_WIN32
+	if (output.map && 0 != ftruncate(output.fd, hxd_setout(output.X, NULL, 0)))
+		warn("%s", output.path);
+#endif
+} /* output_abort() */
+
+
+static void output_open(struct hexdump *X, char **path, int count, size_t off, size_t max) {
+#if !_WIN32
+	struct stat st;
+	size_t total = 0, size;
+	off_t pos;
+	int i;
+
+	if (!count) {
+		if (0 != fstat(STDIN_FILENO, &st) || !S_ISREG(st.st_mode) || -1 == (pos = lseek(STDIN_FILENO, 0, SEEK_CUR)))
+			return /* void */;
+
+		total = (pos < st.st_size)? st.st_size - pos : 0;
+	}
+
+	for (i = 0; i < count; i++) {
+		if (0 != stat(path[i], &st) || !S_ISREG(st.st_mode))
+			return /* void */;
+
+		total += st.st_size;
+	}
+
+	total = (total > off)? MIN(total - off, max) : 0;
+
+	if (SIZE_MAX == (size = hxd_outsize(X, total)) || !size || (off_t)size < 0)
+		return /* void */;
+
+	if (-1 == (output.fd = open(output.path, O_RDWR)))
+		err(EXIT_FAILURE, "%s", output.path);
+
+	if (0 != ftruncate(output.fd, size))
+		err(EXIT_FAILURE, "%s", output.path);
+
+	if (MAP_FAILED == (output.map = mmap(NULL, size, PROT_READ|PROT_WRITE, MAP_SHARED, output.fd, 0))) {
+		output.map = NULL;
+
+		/* written through stdout instead, from the start */
+		if (0 != ftruncate(output.fd, 0))
+			err(EXIT_FAILURE, "%s", output.path);
+
+		output_close();
+
+		return /* void */;
+	}
+
+	output.size = size;
+	output.X = X;
+	hxd_setout(X, output.map, size);
+
+	if (0 != atexit(&output_abort))
+		err(EXIT_FAILURE, "atexit");
+#else
+	(void)X; (void)path; (void)count; (void)off; (void)max;
+#endif
+} /* output_open() */
+
+
+/*
+ * Search mode (-S). The input is scanned for the pattern and only blocks
+ * overlapping a match, plus -W blocks before and -A blocks after, are
+ * formatted, at their usual addresses. Runs of selected blocks are
+ * separated by "--" where blocks were left out. The window holds the
+ * unsearched tail, in case a match straddles reads, and enough preceding
+ * blocks for the leading context.
+ */
+#define SEARCH_READSIZE 65536
+
+/* blocks of context shown before and after a match or difference */
+static struct {
+	size_t before, after;
+} context;
+
+static struct {
+	unsigned char *pat;
+	size_t patlen;
+
+	unsigned char *buf;
+	size_t size;
+	size_t base, len; /* buf holds stream octets [base, base + len) */
+	size_t scan; /* earliest offset of an unreported match */
+
+	size_t rs, re; /* unwritten part of the open run of blocks */
+	size_t lastend; /* end of the last run */
+	_Bool on, open, printed;
+} search;
+
+
+static void search_emit(struct hexdump *X) {
+	unsigned char buf[4096];
+	size_t len;
+
+	while ((len = hxd_read(X, buf, sizeof buf)))
+		fwrite(buf, 1, len, stdout);
+} /* search_emit() */
+
+
+/* format the open run up to end, or as far as the window reaches */
+static void search_write(struct hexdump *X, size_t end) {
+	size_t n;
+	int error;
+
+	end = MIN(end, search.base + search.len);
+
+	if (search.rs >= end)
+		return /* void */;
+
+	n = end - search.rs;
+
+	if ((error = hxd_write(X, &search.buf[search.rs - search.base], n)))
+		errx(EXIT_FAILURE, "%s", hxd_strerror(error));
+
+	search.rs += n;
+	search.printed = 1;
+
+	search_emit(X);
+} /* search_write() */
+
+
+static void search_close(struct hexdump *X) {
+	search_write(X, search.re);
+	search.open = 0;
+	search.lastend = search.re;
+} /* search_close() */
+
+
+static void search_match(struct hexdump *X, size_t m) {
+	size_t bs = hxd_blocksize(X), lead = context.before * bs;
+	size_t f = (m / bs) * bs, e;
+
+	f = MAX((f > lead)? f - lead : 0, search.lastend);
+	e = ((m + search.patlen - 1) / bs + 1 + context.after) * bs;
+
+	if (search.open && f <= search.re) {
+		search.re = MAX(search.re, e);
+
+		return /* void */;
+	}
+
+	if (search.open)
+		search_close(X);
+
+	if (search.printed && f > search.lastend)
+		fputs("--\n", stdout);
+
+	hxd_seek(X, f);
+	search.rs = f;
+	search.re = e;
+	search.open = 1;
+} /* search_match() */
+
+
+static void search_scan(struct hexdump *X, _Bool eof) {
+	size_t bs = hxd_blocksize(X), lead = context.before * bs;
+	size_t end = search.base + search.len, lim, keep, m;
+	const unsigned char *p;
+
+	/* a match must fit in the window */
+	lim = (end >= search.patlen)? end - search.patlen + 1 : 0;
+
+	while (search.scan < lim) {
+		if (!(p = memchr(&search.buf[search.scan - search.base], search.pat[0], lim - search.scan)))
+			break;
+
+		m = search.base + (p - search.buf);
+
+		if (!memcmp(p, search.pat, search.patlen))
+			search_match(X, m);
+
+		search.scan = m + 1;
+	}
+
+	search.scan = MAX(search.scan, lim);
+
+	if (search.open)
+		search_write(X, search.re);
+
+	if (eof)
+		return /* void */;
+
+	/* keep what a later match or the open run may still need */
+	keep = (search.scan / bs) * bs;
+	keep = MAX((keep > lead)? keep - lead : 0, search.lastend);
+	keep = MIN(keep, search.scan);
+
+	if (search.open)
+		keep = MIN(keep, search.rs);
+
+	if (keep > search.base) {
+		memmove(search.buf, &search.buf[keep - search.base], end - keep);
+		search.len = end - keep;
+		search.base = keep;
+	}
+} /* search_scan() */
+
+
+/*
+ * Skip up to *off octets of fp, seeking within a seekable file rather
+ * than reading it, and decrement *off by the octets skipped.
+ */
+static void skipin(FILE *fp, size_t *off) {
+	unsigned char buf[4096];
+	long cur, size;
+	size_t n;
+
+	if (*off && -1 != (cur = ftell(fp)) && 0 == fseek(fp, 0, SEEK_END) && -1 != (size = ftell(fp))) {
+		n = (size > cur)? MIN((size_t)(size - cur), *off) : 0;
+
+		if (0 != fseek(fp, cur + (long)n, SEEK_SET))
+			err(EXIT_FAILURE, "fseek");
+
+		*off -= n;
+	}
+
+	while (*off && (n = fread(buf, 1, MIN(sizeof buf, *off), fp)))
+		*off -= n;
+} /* skipin() */
+
+
+/* grow *buf to hold at least need octets */
+static void reserve(unsigned char **buf, size_t *size, size_t need) {
+	unsigned char *tmp;
+	size_t n;
+
+	if (*size >= need)
+		return /* void */;
+
+	n = MAX(*size * 2, need);
+
+	if (!(tmp = realloc(*buf, n)))
+		err(EXIT_FAILURE, "realloc");
+
+	*buf = tmp;
+	*size = n;
+} /* reserve() */
+
+
+static void runsearch(struct hexdump *X, FILE *fp, _Bool flush, size_t *off, size_t *max) {
+	size_t n, end;
+	int error;
+
+	if (!hxd_blocksize(X))
+		errx(EXIT_FAILURE, "-S: format consumes no input");
+
+	skipin(fp, off);
+
+	while (!*off && *max) {
+		reserve(&search.buf, &search.size, search.len + SEARCH_READSIZE);
+
+		if (!(n = fread(&search.buf[search.len], 1, MIN(SEARCH_READSIZE, *max), fp)))
+			break;
+
+		*max -= n;
+		search.len += n;
+		search_scan(X, 0);
+	}
+
+	if (ferror(fp))
+		err(EXIT_FAILURE, "fread");
+
+	if (!flush)
+		return /* void */;
+
+	search_scan(X, 1);
+
+	/* a run reaching the end formats the partial block when flushed */
+	end = search.base + search.len;
+
+	if (!search.open || search.re < end) {
+		if (search.open)
+			search_close(X);
+
+		hxd_seek(X, end);
+	}
+
+	if ((error = hxd_flush(X)))
+		errx(EXIT_FAILURE, "%s", hxd_strerror(error));
+
+	search_emit(X);
+} /* runsearch() */
+
+
+static void setpattern(const char *hex) {
+	const char *p;
+	size_t n = 0;
+	int hi = -1, v;
+
+	if (!(search.pat = malloc(strlen(hex) / 2 + 1)))
+		err(EXIT_FAILURE, "malloc");
+
+	for (p = hex; *p; p++) {
+		if (isspace((unsigned char)*p))
+			continue;
+
+		if (!(v = rev_digit[(unsigned char)*p]) || v > 16)
+			goto invalid;
+
+		if (hi < 0) {
+			hi = v - 1;
+		} else {
+			search.pat[n++] = (hi << 4) | (v - 1);
+			hi = -1;
+		}
+	}
+
+	if (!n || hi >= 0)
+		goto invalid;
+
+	search.patlen = n;
+
+	return /* void */;
+invalid:
+	errx(EXIT_FAILURE, "%s: invalid pattern, expected pairs of hex digits", hex);
+} /* setpattern() */
+
+
+/*
+ * Diff mode (-u). The input is compared block by block with a second
+ * file, and only differing blocks are formatted, the input's with lines
+ * marked "-" and the other file's with lines marked "+", plus -W and -A
+ * blocks of context marked " ". Runs of equal blocks outside the context
+ * are compared wholesale with memcmp(3). -s and -n apply to both files.
+ * The format's epilogue is suppressed, since blocks are formatted out of
+ * order.
+ */
+#define DIFF_READSIZE 65536
+
+static struct {
+	const char *path;
+	FILE *fp;
+	size_t off, max; /* left to skip and compare in the other file */
+	_Bool eof; /* other file exhausted */
+
+	unsigned char *a, *b;
+	size_t asize, bsize;
+	size_t base, alen, blen; /* a and b hold stream octets from base */
+	size_t pos; /* next block to compare */
+	size_t after; /* context blocks still to print */
+	size_t lastend; /* end of the last block printed */
+	_Bool printed, differ;
+} diff;
+
+
+static void diff_print(struct hexdump *X, int mark, const unsigned char *p, size_t n, size_t address) {
+	unsigned char buf[4096];
+	size_t len, i;
+	_Bool bol = 1;
+	int error;
+
+	hxd_seek(X, address);
+
+	if ((error = hxd_write(X, p, n)))
+		errx(EXIT_FAILURE, "%s", hxd_strerror(error));
+
+	if (n < hxd_blocksize(X) && (error = hxd_flush(X)))
+		errx(EXIT_FAILURE, "%s", hxd_strerror(error));
+
+	while ((len = hxd_read(X, buf, sizeof buf))) {
+		for (i = 0; i < len; i++) {
+			if (bol)
+				putchar(mark);
+
+			putchar(buf[i]);
+			bol = (buf[i] == '\n');
+		}
+	}
+
+	if (!bol)
+		putchar('\n');
+} /* diff_print() */
+
+
+static void diff_hunk(struct hexdump *X, size_t na, size_t nb) {
+	size_t bs = hxd_blocksize(X), lead = context.before * bs, q;
+
+	q = MAX((diff.pos > lead)? diff.pos - lead : 0, diff.lastend);
+
+	if (diff.printed && q > diff.lastend)
+		fputs("--\n", stdout);
+
+	for (; q < diff.pos; q += bs)
+		diff_print(X, ' ', &diff.a[q - diff.base], bs, q);
+
+	if (na)
+		diff_print(X, '-', &diff.a[diff.pos - diff.base], na, diff.pos);
+
+	if (nb)
+		diff_print(X, '+', &diff.b[diff.pos - diff.base], nb, diff.pos);
+
+	diff.printed = 1;
+	diff.differ = 1;
+} /* diff_hunk() */
+
+
+/* read the other file up to the same offset as the input */
+static void diff_fill(size_t end) {
+	size_t n;
+
+	while (!diff.eof && diff.base + diff.blen < end) {
+		reserve(&diff.b, &diff.bsize, end - diff.base);
+
+		n = MIN(end - (diff.base + diff.blen), diff.max);
+
+		if (!n || !(n = fread(&diff.b[diff.blen], 1, n, diff.fp))) {
+			if (ferror(diff.fp))
+				err(EXIT_FAILURE, "%s", diff.path);
+
+			diff.eof = 1;
+
+			break;
+		}
+
+		diff.blen += n;
+		diff.max -= n;
+	}
+} /* diff_fill() */
+
+
+static void diff_scan(struct hexdump *X, _Bool eof) {
+	size_t bs = hxd_blocksize(X), lead = context.before * bs;
+	size_t aend, bend, na, nb, span, keep, n;
+
+	for (;;) {
+		aend = diff.base + diff.alen;
+		bend = diff.base + diff.blen;
+
+		if ((aend < diff.pos + bs && !eof) || (bend < diff.pos + bs && !diff.eof))
+			break;
+
+		na = (aend > diff.pos)? MIN(bs, aend - diff.pos) : 0;
+		nb = (bend > diff.pos)? MIN(bs, bend - diff.pos) : 0;
+
+		if (!na && !nb)
+			break;
+
+		/* skip equal full blocks wholesale */
+		if (!diff.after && na == bs && nb == bs) {
+			span = ((MIN(aend, bend) - diff.pos) / bs) * bs;
+
+			if (!memcmp(&diff.a[diff.pos - diff.base], &diff.b[diff.pos - diff.base], span)) {
+				diff.pos += span;
+
+				continue;
+			}
+		}
+
+		if (na != nb || memcmp(&diff.a[diff.pos - diff.base], &diff.b[diff.pos - diff.base], na)) {
+			diff_hunk(X, na, nb);
+			diff.after = context.after;
+			diff.lastend = diff.pos + bs;
+		} else if (diff.after) {
+			diff_print(X, ' ', &diff.a[diff.pos - diff.base], na, diff.pos);
+			diff.after--;
+			diff.lastend = diff.pos + bs;
+		}
+
+		diff.pos += bs;
+	}
+
+	/* keep the blocks a later difference may print as context */
+	keep = MAX((diff.pos > lead)? diff.pos - lead : 0, diff.lastend);
+	keep = MIN(keep, diff.pos);
+
+	if (keep > diff.base) {
+		n = keep - diff.base;
+
+		if (diff.alen > n)
+			memmove(diff.a, &diff.a[n], diff.alen - n);
+		if (diff.blen > n)
+			memmove(diff.b, &diff.b[n], diff.blen - n);
+
+		diff.alen = (diff.alen > n)? diff.alen - n : 0;
+		diff.blen = (diff.blen > n)? diff.blen - n : 0;
+		diff.base = keep;
+	}
+} /* diff_scan() */
+
+
+static void rundiff(struct hexdump *X, FILE *fp, _Bool flush, size_t *off, size_t *max) {
+	size_t n;
+
+	if (!hxd_blocksize(X))
+		errx(EXIT_FAILURE, "-u: format consumes no input");
+
+	X->ended = 1; /* no epilogue */
+
+	skipin(diff.fp, &diff.off);
+	skipin(fp, off);
+
+	while (!*off && *max) {
+		reserve(&diff.a, &diff.asize, diff.alen + DIFF_READSIZE);
+
+		if (!(n = fread(&diff.a[diff.alen], 1, MIN(DIFF_READSIZE, *max), fp)))
+			break;
+
+		*max -= n;
+		diff.alen += n;
+		diff_fill(diff.base + diff.alen);
+		diff_scan(X, 0);
+	}
+
+	if (ferror(fp))
+		err(EXIT_FAILURE, "fread");
+
+	if (!flush)
+		return /* void */;
+
+	/* the rest of the other file is all differences */
+	do {
+		diff_fill(diff.base + diff.blen + DIFF_READSIZE);
+		diff_scan(X, 1);
+	} while (!diff.eof);
+
+	diff_scan(X, 1);
+} /* rundiff() */
+
+
+#if HAVE_PTHREAD
+/*
+ * Pipelined mode (-T): a reader thread fills input buffers and a writer
+ * thread drains output buffers while the main thread formats, so disk and
+ * CPU overlap. Each ring has a single producer and a single consumer;
+ * slots [head, tail) are full and owned by the consumer, the rest by the
+ * producer.
+ */
+#define PIPE_NSLOTS 4
+#define PIPE_SLOTSIZE (1 << 18)
+
+struct pipe_slot {
+	unsigned char *base;
+	size_t size, len;
+}; /* struct pipe_slot */
+
+struct pipe_ring {
+	pthread_mutex_t mutex;
+	pthread_cond_t cond;
+	struct pipe_slot slot[PIPE_NSLOTS];
+	unsigned head, tail;
+	_Bool eof;
+}; /* struct pipe_ring */
+
+struct pipeline {
+	struct pipe_ring in, out;
+	int fd;
+	size_t *off, *max;
+}; /* struct pipeline */
+
+
+static void ring_init(struct pipe_ring *R, size_t size) {
+	unsigned i;
+
+	memset(R, 0, sizeof *R);
+	pthread_mutex_init(&R->mutex, NULL);
+	pthread_cond_init(&R->cond, NULL);
+
+	for (i = 0; size && i < PIPE_NSLOTS; i++) {
+		if (!(R->slot[i].base = malloc(size)))
+			err(EXIT_FAILURE, "malloc");
+		R->slot[i].size = size;
+	}
+} /* ring_init() */
+
+
+static void ring_destroy(struct pipe_ring *R) {
+	unsigned i;
+
+	for (i = 0; i < PIPE_NSLOTS; i++)
+		free(R->slot[i].base);
+
+	pthread_cond_destroy(&R->cond);
+	pthread_mutex_destroy(&R->mutex);
+} /* ring_destroy() */
+
+
+/* wait for an empty slot to fill */
+static struct pipe_slot *ring_reserve(struct pipe_ring *R) {
+	struct pipe_slot *slot;
+
+	pthread_mutex_lock(&R->mutex);
+	while (R->tail - R->head == PIPE_NSLOTS)
+		pthread_cond_wait(&R->cond, &R->mutex);
+	slot = &R->slot[R->tail % PIPE_NSLOTS];
+	pthread_mutex_unlock(&R->mutex);
+
+	return slot;
+} /* ring_reserve() */
+
+
+/* pass the reserved slot, or with eof end of stream, to the consumer */
+static void ring_commit(struct pipe_ring *R, _Bool eof) {
+	pthread_mutex_lock(&R->mutex);
+	if (eof)
+		R->eof = 1;
+	else
+		R->tail++;
+	pthread_cond_signal(&R->cond);
+	pthread_mutex_unlock(&R->mutex);
+} /* ring_commit() */
+
+
+/* wait for a full slot, or NULL at end of stream */
+static struct pipe_slot *ring_get(struct pipe_ring *R) {
+	struct pipe_slot *slot = NULL;
+
+	pthread_mutex_lock(&R->mutex);
+	while (R->head == R->tail && !R->eof)
+		pthread_cond_wait(&R->cond, &R->mutex);
+	if (R->head != R->tail)
+		slot = &R->slot[R->head % PIPE_NSLOTS];
+	pthread_mutex_unlock(&R->mutex);
+
+	return slot;
+} /* ring_get() */
+
+
+/* return the slot from ring_get() to the producer */
+static void ring_release(struct pipe_ring *R) {
+	pthread_mutex_lock(&R->mutex);
+	R->head++;
+	pthread_cond_signal(&R->cond);
+	pthread_mutex_unlock(&R->mutex);
+} /* ring_release() */
+
+
+static void *pipe_reader(void *arg) {
+	struct pipeline *P = arg;
+	struct pipe_slot *slot;
+	struct stat st;
+	off_t pos;
+	ssize_t n;
+
+	if (*P->off && 0 == fstat(P->fd, &st) && S_ISREG(st.st_mode) && -1 != (pos = lseek(P->fd, 0, SEEK_CUR))) {
+		size_t skip = (pos < st.st_size)? (size_t)MIN((uintmax_t)(st.st_size - pos), *P->off) : 0;
+
+		if (-1 == lseek(P->fd, skip, SEEK_CUR))
+			err(EXIT_FAILURE, "lseek");
+		*P->off -= skip;
+	}
+
+	while (*P->off || *P->max) {
+		slot = ring_reserve(&P->in);
+
+		if (*P->off)
+			n = read(P->fd, slot->base, MIN(slot->size, *P->off));
+		else
+			n = read(P->fd, slot->base, MIN(slot->size, *P->max));
+
+		if (n == -1) {
+			if (errno == EINTR)
+				continue;
+			err(EXIT_FAILURE, "read");
+		} else if (!n) {
+			break;
+		} else if (*P->off) {
+			*P->off -= n;
+		} else {
+			*P->max -= n;
+			slot->len = n;
+			ring_commit(&P->in, 0);
+		}
+	}
+
+	ring_commit(&P->in, 1);
+
+	return NULL;
+} /* pipe_reader() */
+
+
+static void *pipe_writer(void *arg) {
+	struct pipeline *P = arg;
+	struct pipe_slot *slot;
+	size_t p;
+	ssize_t n;
+
+	while ((slot = ring_get(&P->out))) {
+		for (p = 0; p < slot->len; p += n) {
+			if (-1 == (n = write(STDOUT_FILENO, &slot->base[p], slot->len - p))) {
+				if (errno != EINTR)
+					err(EXIT_FAILURE, "write");
+				n = 0;
+			}
+		}
+
+		ring_release(&P->out);
+	}
+
+	return NULL;
+} /* pipe_writer() */
+
+
+/* hand pending output to the writer thread */
+static void pipe_emit(struct pipeline *P, struct hexdump *X) {
+	struct pipe_slot *slot;
+	size_t n;
+
+	if (!(n = X->vm.o.p - X->vm.o.base))
+		return;
+
+	slot = ring_reserve(&P->out);
+
+	if (slot->size < n) {
+		free(slot->base);
+		if (!(slot->base = malloc(n)))
+			err(EXIT_FAILURE, "malloc");
+		slot->size = n;
+	}
+
+	slot->len = hxd_read(X, slot->base, n);
+	ring_commit(&P->out, 0);
+} /* pipe_emit() */
+
+
+static void runpipe(struct hexdump *X, FILE *fp, _Bool flush, size_t *off, size_t *max) {
+	struct pipeline P;
+	struct pipe_slot *slot;
+	pthread_t reader, writer;
+	int error;
+
+	fflush(stdout);
+
+	ring_init(&P.in, PIPE_SLOTSIZE);
+	ring_init(&P.out, 0);
+	P.fd = fileno(fp);
+	P.off = off;
+	P.max = max;
+
+	if ((error = pthread_create(&reader, NULL, &pipe_reader, &P))
+	||  (error = pthread_create(&writer, NULL, &pipe_writer, &P)))
+		errx(EXIT_FAILURE, "pthread_create: %s", strerror(error));
+
+	while ((slot = ring_get(&P.in))) {
+		if ((error = hxd_write(X, slot->base, slot->len)))
+			errx(EXIT_FAILURE, "%s", hxd_strerror(error));
+
+		ring_release(&P.in);
+		pipe_emit(&P, X);
+	}
+
+	if (flush) {
+		if ((error = hxd_flush(X)))
+			errx(EXIT_FAILURE, "%s", hxd_strerror(error));
+
+		pipe_emit(&P, X);
+	}
+
+	ring_commit(&P.out, 1);
+
+	pthread_join(reader, NULL);
+	pthread_join(writer, NULL);
+
+	ring_destroy(&P.in);
+	ring_destroy(&P.out);
+} /* runpipe() */
+
+
+/*
+ * Parallel mode (-j N). The files are one stream, as when run() formats
+ * them in turn, cut into jobs at the first block boundary of each file so
+ * that a block straddling files goes with the first. Each job is formatted
+ * by the context of whichever worker claims it, seeked to the job's
+ * address, and its output held until every earlier job has written; the
+ * oldest job writes as it goes. Addresses come from stat(2) before any
+ * file is read, so only regular files qualify, and a file that shrinks
+ * meanwhile leaves a gap rather than shifting later addresses.
+ */
+#define FILES_BUFSIZE 65536
+
+struct files {
+	pthread_mutex_t mutex;
+	pthread_cond_t cond;
+
+	unsigned char img[IMG_HDRSIZE + sizeof ((struct vm_state *)0)->code + IMG_SUMSIZE];
+	size_t imglen;
+
+	char **path;
+	size_t *start; /* stream offset of each file, then the total */
+	size_t *edge; /* stream offset of each job, then the end */
+	int count;
+	int last; /* job which flushes */
+	size_t begin; /* stream offset of address 0 */
+
+	int next, turn; /* next job to claim, job allowed to write */
+}; /* struct files */
+
+
+static void files_emit(struct files *F, struct hexdump *X, int job, _Bool done) {
+	int error;
+
+	pthread_mutex_lock(&F->mutex);
+
+	if (F->turn != job && !done) {
+		pthread_mutex_unlock(&F->mutex);
+
+		return /* void */;
+	}
+
+	while (F->turn != job)
+		pthread_cond_wait(&F->cond, &F->mutex);
+
+	pthread_mutex_unlock(&F->mutex);
+
+	if ((error = hxd_drain(X, STDOUT_FILENO)))
+		errx(EXIT_FAILURE, "write: %s", hxd_strerror(error));
+
+	if (done) {
+		pthread_mutex_lock(&F->mutex);
+		F->turn++;
+		pthread_cond_broadcast(&F->cond);
+		pthread_mutex_unlock(&F->mutex);
+	}
+} /* files_emit() */
+
+
+static void files_job(struct files *F, struct hexdump *X, int job, unsigned char *buf) {
+	size_t pos = F->edge[job], end = F->edge[job + 1], lim;
+	int k = job, fd, error;
+	ssize_t n;
+
+	hxd_reset(X);
+	hxd_seek(X, pos - F->begin);
+
+	while (pos < end) {
+		while (F->start[k + 1] <= pos)
+			k++;
+
+		if (-1 == (fd = open(F->path[k], O_RDONLY)))
+			err(EXIT_FAILURE, "%s", F->path[k]);
+
+		lim = MIN(end, F->start[k + 1]);
+
+		while (pos < lim) {
+			n = pread(fd, buf, MIN(FILES_BUFSIZE, lim - pos), pos - F->start[k]);
+
+			if (n == -1) {
+				if (errno == EINTR)
+					continue;
+				err(EXIT_FAILURE, "%s", F->path[k]);
+			} else if (!n) {
+				break;
+			}
+
+			pos += n;
+
+			if ((error = hxd_write(X, buf, n)))
+				errx(EXIT_FAILURE, "%s", hxd_strerror(error));
+
+			files_emit(F, X, job, 0);
+		}
+
+		close(fd);
+		pos = lim;
+	}
+
+	if (job == F->last && (error = hxd_flush(X)))
+		errx(EXIT_FAILURE, "%s", hxd_strerror(error));
+
+	files_emit(F, X, job, 1);
+} /* files_job() */
+
+
+static void *files_worker(void *arg) {
+	struct files *F = arg;
+	struct hexdump *X;
+	unsigned char *buf;
+	int job, error;
+
+	if (!(X = hxd_open(&error)) || (error = hxd_load(X, F->img, F->imglen)))
+		errx(EXIT_FAILURE, "open: %s", hxd_strerror(error));
+
+	if (!(buf = malloc(FILES_BUFSIZE)))
+		err(EXIT_FAILURE, "malloc");
+
+	for (;;) {
+		pthread_mutex_lock(&F->mutex);
+		job = F->next++;
+		pthread_mutex_unlock(&F->mutex);
+
+		if (job >= F->count)
+			break;
+
+		files_job(F, X, job, buf);
+	}
 
-#define YIELD(rv)                                                       \
-	SAVE_AND_DO(return (rv))
+	free(buf);
+	hxd_close(X);
 
-#define LEAVE                                                           \
-	SAVE_AND_DO(break);                                             \
-	}                                                               \
-	} while (0)
+	return NULL;
+} /* files_worker() */
 
-int getopt(int argc, char *const argv[], const char *shortopts) {
-	static unsigned pc;
-	static char *cp;
 
-	optopt = 0;
-	optarg = NULL;
+/* returns false, having done nothing, if the files don't qualify */
+static _Bool runfiles(struct hexdump *X, char **path, int count, int nthread, size_t *off, size_t *max) {
+	struct files F = { .path = path, .count = count };
+	size_t bs = hxd_blocksize(X), end, q;
+	pthread_t *thread;
+	struct stat st;
+	int i, error;
 
-	ENTER;
+	if (!bs || count < 2)
+		return 0;
 
-	while (optind < argc) {
-		cp = argv[optind];
+	if (!(F.imglen = hxd_save(X, F.img, sizeof F.img)) || F.imglen > sizeof F.img)
+		return 0;
 
-		if (*cp != '-' || !strcmp(cp, "-")) {
-			break;
-		} else if (!strcmp(cp, "--")) {
-			optind++;
-			break;
-		}
+	if (!(F.start = calloc(count + 1, sizeof *F.start)) || !(F.edge = calloc(count + 1, sizeof *F.edge)))
+		err(EXIT_FAILURE, "calloc");
 
-		for (;;) {
-			char *shortopt;
+	for (i = 0; i < count; i++) {
+		if (0 != stat(path[i], &st) || !S_ISREG(st.st_mode)) {
+			free(F.start);
+			free(F.edge);
 
-			if (!(optopt = *++cp)) {
-				optind++;
-				break;
-			} else if (!(shortopt = strchr(shortopts, optopt))) {
-				if (*shortopts != ':' && opterr)
-					warnx("illegal option -- %c", optopt);
-				YIELD('?');
-			} else if (shortopt[1] != ':') {
-				YIELD(optopt);
-			} else if (cp[1]) {
-				optarg = &cp[1];
-				optind++;
-				YIELD(optopt);
-				break;
-			} else if (optind + 1 < argc) {
-				optarg = argv[optind + 1];
-				optind += 2;
-				YIELD(optopt);
-				break;
-			} else {
-				if (*shortopts != ':' && opterr)
-					warnx("option requires an argument -- %c", optopt);
-				optind++;
-				YIELD((*shortopts == ':')? ':' : '?');
-				break;
-			}
+			return 0;
 		}
+
+		F.start[i + 1] = F.start[i] + st.st_size;
 	}
 
-	LEAVE;
+	F.begin = MIN(*off, F.start[count]);
+	end = F.begin + MIN(*max, F.start[count] - F.begin);
+	*off -= F.begin;
+	*max -= end - F.begin;
 
-	return -1;
-}
-#endif /* HAVE_GETOPT */
+	F.edge[0] = F.begin;
+	F.edge[count] = end;
+	F.last = count - 1;
 
+	for (i = 1; i < count; i++) {
+		q = (F.start[i] > F.begin)? F.start[i] - F.begin : 0;
+		q = ((q + bs - 1) / bs) * bs;
+		F.edge[i] = (q < end - F.begin)? F.begin + q : end;
+	}
 
-static void run(struct hexdump *X, FILE *fp, _Bool flush, size_t *off, size_t *max) {
-	char buf[256];
-	size_t len;
-	int error;
+	/* the partial block, and any epilogue, go with the last data */
+	while (F.last > 0 && F.edge[F.last] == end)
+		F.last--;
 
-	/* TODO: need to update the dump address after skipping */
-	if (*off) {
-		long n = MIN(LONG_MAX, *off);
-		if (0 == fseek(fp, n, SEEK_SET))
-			*off -= n;
-		while (*off && (len = fread(buf, 1, MIN(sizeof buf, *off), fp)))
-			*off -= len;
-	}
+	pthread_mutex_init(&F.mutex, NULL);
+	pthread_cond_init(&F.cond, NULL);
 
-	while (*max && (len = fread(buf, 1, MIN(sizeof buf, *max), fp))) {
-		*max -= len;
-		if ((error = hxd_write(X, buf, len)))
-			errx(EXIT_FAILURE, "%s", hxd_strerror(error));
+	nthread = MIN(nthread, count);
 
-		while ((len = hxd_read(X, buf, sizeof buf)))
-			fwrite(buf, 1, len, stdout);
-	}
+	if (!(thread = calloc(nthread, sizeof *thread)))
+		err(EXIT_FAILURE, "calloc");
 
-	if (flush) {
-		if ((error = hxd_flush(X)))
-			errx(EXIT_FAILURE, "%s", hxd_strerror(error));
+	fflush(stdout);
 
-		while ((len = hxd_read(X, buf, sizeof buf)))
-			fwrite(buf, 1, len, stdout);
+	for (i = 0; i < nthread; i++) {
+		if ((error = pthread_create(&thread[i], NULL, &files_worker, &F)))
+			errx(EXIT_FAILURE, "pthread_create: %s", strerror(error));
 	}
-} /* run() */
+
+	for (i = 0; i < nthread; i++)
+		pthread_join(thread[i], NULL);
+
+	pthread_cond_destroy(&F.cond);
+	pthread_mutex_destroy(&F.mutex);
+
+	free(thread);
+	free(F.start);
+	free(F.edge);
+
+	return 1;
+} /* runfiles() */
+#endif
 
 
 static size_t tosize(const char *optarg) {
@@ -2102,11 +6735,105 @@ static size_t tosize(const char *optarg) {
 }
 
 
+/*
+ * Create a new, uniquely named file beside a cache entry. Other users may
+ * be able to write the cache directory, so a predictable name would let
+ * them plant a symbolic link for us to follow.
+ */
+static FILE *cache_tmp(char *tmp, size_t lim, const char *path) {
+#if !_WIN32
+	FILE *fp;
+	int fd;
+
+	snprintf(tmp, lim, "%s.XXXXXX", path);
+
+	if (-1 == (fd = mkstemp(tmp)))
+		return NULL;
+
+	if (!(fp = fdopen(fd, "wb"))) {
+		close(fd);
+		remove(tmp);
+	}
+
+	return fp;
+#else
+	snprintf(tmp, lim, "%s.%lu", path, (unsigned long)getpid());
+
+	return fopen(tmp, "wb");
+#endif
+} /* cache_tmp() */
+
+
+/*
+ * With $HEXDUMP_CACHE naming a directory, compiled programs are kept there
+ * in files named by a hash of the format and flags, and later runs load
+ * them with hxd_load() instead of compiling. A missing, stale or corrupt
+ * entry is silently recompiled and replaced, as is one owned by another
+ * user. Entries are written to a temporary file and renamed, so concurrent
+ * runs never see partial ones.
+ */
+static int compile(struct hexdump *X, const char *fmt, int flags) {
+	unsigned char img[IMG_HDRSIZE + sizeof X->vm.code + IMG_SUMSIZE];
+	char path[4096], tmp[sizeof path + 32];
+	const char *dir;
+	uint64_t key;
+	size_t len;
+	FILE *fp;
+	int error;
+
+	if (!(dir = getenv("HEXDUMP_CACHE")) || !*dir || (flags & HXD_REVERSE))
+		return hxd_compile(X, fmt, flags);
+
+	key = fnv1a(FNV1A_INIT, fmt, strlen(fmt));
+	key = fnv1a(key, &flags, sizeof flags);
+
+	if ((size_t)snprintf(path, sizeof path, "%s/%016llx.hxd", dir, (unsigned long long)key) >= sizeof path)
+		return hxd_compile(X, fmt, flags);
+
+	if ((fp = fopen(path, "rb"))) {
+#if !_WIN32
+		struct stat st;
+
+		/* an entry planted by another user could loop forever */
+		if (0 == fstat(fileno(fp), &st) && st.st_uid == getuid())
+			len = fread(img, 1, sizeof img, fp);
+		else
+			len = 0;
+#else
+		len = fread(img, 1, sizeof img, fp);
+#endif
+
+		fclose(fp);
+
+		if (len && !hxd_load(X, img, len))
+			return 0;
+	}
+
+	if ((error = hxd_compile(X, fmt, flags)))
+		return error;
+
+	if (!(len = hxd_save(X, img, sizeof img)) || len > sizeof img)
+		return 0;
+
+	if ((fp = cache_tmp(tmp, sizeof tmp, path))) {
+		_Bool ok = (len == fwrite(img, 1, len, fp));
+
+		if (0 != fclose(fp) || !ok || 0 != rename(tmp, path))
+			remove(tmp);
+	}
+
+	return 0;
+} /* compile() */
+
+
 int main(int argc, char **argv) {
 	extern char *optarg;
 	extern int optind;
 	int opt, flags = 0;
-	_Bool dump = 0;
+	_Bool dump = 0, profile = 0, autocolor = 0;
+	const char *generate = NULL;
+	size_t nthread = 1;
+	void (*runfn)(struct hexdump *, FILE *, _Bool, size_t *, size_t *) = &run;
 	struct hexdump *X;
 	char *fmt = HEXDUMP_x, fmtbuf[512];
 	size_t len;
@@ -2114,7 +6841,7 @@ int main(int argc, char **argv) {
 	size_t off = 0;
 	int error;
 
-	while (-1 != (opt = getopt(argc, argv, "bcCde:f:n:os:xiBLPDVh"))) {
+	while (-1 != (opt = getopt(argc, argv, "bcCde:f:n:os:w:xiJBLPrDG:pTj:S:u:A:W:k:Vh"))) {
 		switch (opt) {
 		case 'b':
 			fmt = HEXDUMP_b;
@@ -2162,6 +6889,10 @@ int main(int argc, char **argv) {
 		case 's':
 			off = tosize(optarg);
 
+			break;
+		case 'w':
+			output.path = optarg;
+
 			break;
 		case 'x':
 			fmt = HEXDUMP_x;
@@ -2170,6 +6901,11 @@ int main(int argc, char **argv) {
 		case 'i':
 			fmt = HEXDUMP_i;
 
+			break;
+		case 'J':
+			fmt = HEXDUMP_J;
+			flags |= HXD_JSON;
+
 			break;
 		case 'B':
 			flags |= HXD_BIG_ENDIAN;
@@ -2182,11 +6918,78 @@ int main(int argc, char **argv) {
 		case 'P':
 			flags |= HXD_NOPADDING;
 
+			break;
+		case 'r':
+			flags |= HXD_REVERSE;
+
 			break;
 		case 'D':
 			dump = 1;
 
 			break;
+		case 'G':
+			if (optarg[strspn(optarg, "_abcdefghijklmnopqrstuvwxyzABCDEFGHIJKLMNOPQRSTUVWXYZ0123456789")] || (*optarg >= '0' && *optarg <= '9') || !*optarg)
+				errx(EXIT_FAILURE, "%s: invalid C identifier", optarg);
+
+			generate = optarg;
+
+			break;
+		case 'p':
+			if (!VM_PROFILE)
+				errx(EXIT_FAILURE, "-p: rebuild with -DVM_PROFILE to enable profiling");
+
+			profile = 1;
+
+			break;
+		case 'T':
+#if HAVE_PTHREAD
+			runfn = &runpipe;
+
+			break;
+#else
+			errx(EXIT_FAILURE, "-T: rebuild with -DHAVE_PTHREAD to enable threads");
+#endif
+		case 'S':
+			setpattern(optarg);
+			search.on = 1;
+
+			break;
+		case 'u':
+			diff.path = optarg;
+
+			break;
+		case 'k':
+			if (!strcmp(optarg, "always")) {
+				flags |= HXD_COLOR;
+				autocolor = 0;
+			} else if (!strcmp(optarg, "auto")) {
+				flags &= ~HXD_COLOR;
+				autocolor = 1;
+			} else if (!strcmp(optarg, "never")) {
+				flags &= ~HXD_COLOR;
+				autocolor = 0;
+			} else {
+				errx(EXIT_FAILURE, "%s: expected always, auto or never", optarg);
+			}
+
+			break;
+		case 'A':
+			context.after = tosize(optarg);
+
+			break;
+		case 'W':
+			context.before = tosize(optarg);
+
+			break;
+		case 'j':
+#if HAVE_PTHREAD
+			if (!(nthread = tosize(optarg)) || nthread > 1024)
+				errx(EXIT_FAILURE, "%s: invalid number of threads", optarg);
+
+			break;
+#else
+			errx(EXIT_FAILURE, "-j: rebuild with -DHAVE_PTHREAD to enable threads");
+#endif
 		case 'V':
 			printf("%s (hexdump.c) %.8X\n", argv[0], hxd_version());
 			printf("built   %s %s\n", __DATE__, __TIME__);
@@ -2200,7 +7003,7 @@ int main(int argc, char **argv) {
 			FILE *fp = (opt == 'h')? stdout : stderr;
 
 			fprintf(fp,
-				"hexdump [-bcCde:f:n:os:xiBLPDVh] [file ...]\n" \
+				"hexdump [-bcCde:f:n:os:w:xiJBLPrDG:pTj:S:u:A:W:k:Vh] [file ...]\n" \
 				"  -b       one-byte octal display\n" \
 				"  -c       one-byte character display\n" \
 				"  -C       canonical hex+ASCII display\n" \
@@ -2210,12 +7013,24 @@ int main(int argc, char **argv) {
 				"  -n NUM   dump maximum size\n" \
 				"  -o       two-byte octal display\n" \
 				"  -s NUM   skip offset bytes\n" \
+				"  -w PATH  write to PATH, mapped when the input size is known\n" \
 				"  -x       two-byte hexadecimal display\n" \
 				"  -i       one-byte hexadecimal like xxd -i\n" \
+				"  -J       JSON object per line, escaping text of -e formats\n" \
 				"  -B       load words big-endian\n" \
 				"  -L       load words little-endian\n" \
 				"  -P       disable padding\n" \
+				"  -r       reverse a dump back to binary\n" \
 				"  -D       dump the compiled machine\n" \
+				"  -G NAME  print C source for the format as function NAME\n" \
+				"  -p       print a profile of the machine at exit\n" \
+				"  -T       overlap reading, formatting and writing\n" \
+				"  -j NUM   format files on NUM threads\n" \
+				"  -S HEX   only dump blocks matching the octets HEX\n" \
+				"  -u PATH  only dump blocks differing from PATH\n" \
+				"  -A NUM   with -S or -u, also dump NUM blocks after each\n" \
+				"  -W NUM   with -S or -u, also dump NUM blocks before each\n" \
+				"  -k WHEN  colour octets by class: always, auto or never\n" \
 				"  -V       print version\n" \
 				"  -h       print usage help\n" \
 				"\n" \
@@ -2230,10 +7045,60 @@ int main(int argc, char **argv) {
 	argc -= optind;
 	argv += optind;
 
+	if (flags & HXD_JSON) {
+		if (flags & HXD_REVERSE)
+			errx(EXIT_FAILURE, "-J: not supported with -r");
+		if (search.on || diff.path)
+			errx(EXIT_FAILURE, "-J: not supported with -S or -u");
+
+		flags &= ~HXD_COLOR;
+	}
+
+	if (search.on) {
+		if (flags & HXD_REVERSE)
+			errx(EXIT_FAILURE, "-S: not supported with -r");
+
+		runfn = &runsearch;
+		nthread = 1;
+	}
+
+	if (diff.path) {
+		if (flags & HXD_REVERSE)
+			errx(EXIT_FAILURE, "-u: not supported with -r");
+		if (search.on)
+			errx(EXIT_FAILURE, "-u: not supported with -S");
+
+		if (!(diff.fp = fopen(diff.path, "rb")))
+			err(EXIT_FAILURE, "%s", diff.path);
+
+		diff.off = off;
+		diff.max = max;
+		runfn = &rundiff;
+		nthread = 1;
+	}
+
+	if (output.path && !freopen(output.path, "wb", stdout))
+		err(EXIT_FAILURE, "%s", output.path);
+
+	/* -k auto is settled once -w has decided where output goes */
+	if (autocolor && !output.path && !(flags & HXD_JSON)) {
+		const char *term = getenv("TERM");
+
+		if (isatty(STDOUT_FILENO) && !getenv("NO_COLOR") && (!term || strcmp(term, "dumb")))
+			flags |= HXD_COLOR;
+	}
+
 	if (!(X = hxd_open(&error)))
 		errx(EXIT_FAILURE, "open: %s", hxd_strerror(error));
 
-	if ((error = hxd_compile(X, fmt, flags)))
+	if (generate) {
+		if ((error = hxd_generate(X, fmt, flags, generate, stdout)))
+			errx(EXIT_FAILURE, "%s: %s", fmt, hxd_strerror(error));
+
+		goto exit;
+	}
+
+	if ((error = compile(X, fmt, flags)))
 		errx(EXIT_FAILURE, "%s: %s", fmt, hxd_strerror(error));
 
 	if (dump) {
@@ -2242,11 +7107,22 @@ int main(int argc, char **argv) {
 		goto exit;
 	}
 
+#if !HAVE_PTHREAD
+	(void)nthread;
+#endif
+
+	if (output.path && runfn == &run && nthread == 1)
+		output_open(X, argv, argc, off, max);
+
 	if (!argc) {
 #ifdef _WIN32
 		_setmode(_fileno(stdin), _O_BINARY);
 #endif
-		run(X, stdin, 1, &off, &max);
+		runfn(X, stdin, 1, &off, &max);
+#if HAVE_PTHREAD
+	} else if (nthread > 1 && runfiles(X, argv, argc, nthread, &off, &max)) {
+		/* formatted on nthread threads */
+#endif
 	} else {
 		int i;
 
@@ -2256,15 +7132,187 @@ int main(int argc, char **argv) {
 			if (!(fp = fopen(argv[i], "rb")))
 				err(EXIT_FAILURE, "%s", argv[i]);
 
-			run(X, fp, !argv[i + 1], &off, &max);
+			runfn(X, fp, !argv[i + 1], &off, &max);
 
 			fclose(fp);
 		}
 	}
+
+	output_close();
+
+#if VM_PROFILE
+	if (profile)
+		vm_profile(&X->vm, stderr);
+#else
+	(void)profile;
+#endif
 exit:
 	hxd_close(X);
 
-	return 0;
+	if (diff.fp)
+		fclose(diff.fp);
+
+	/* like cmp(1) and diff(1) */
+	return (diff.differ)? 1 : 0;
 } /* main() */
 
 #endif /* HEXDUMP_MAIN */
+
+
+#if HEXDUMP_BENCH
+
+#include <stdlib.h> /* strtoul(3) */
+#include <stdio.h>  /* printf(3) */
+#include <string.h> /* strcmp(3) */
+#include <time.h>   /* CLOCK_MONOTONIC clock_gettime(3) */
+
+#include <err.h>    /* err(3) errx(3) */
+#include <unistd.h> /* getopt(3) */
+
+
+static double bench_now(void) {
+	struct timespec ts;
+
+	if (0 != clock_gettime(CLOCK_MONOTONIC, &ts))
+		err(EXIT_FAILURE, "clock_gettime");
+
+	return ts.tv_sec + (ts.tv_nsec / 1e9);
+} /* bench_now() */
+
+
+/*
+ * Feed size octets of synthetic input through hxd_write() in chunks of
+ * bufsiz octets, draining output with hxd_read() after every chunk.
+ */
+static void bench_run(const char *name, const char *fmt, int flags, const unsigned char *src, size_t size, size_t bufsiz) {
+	static char buf[65536];
+	struct hexdump *X;
+	unsigned long nalloc;
+	size_t len, n, p, out = 0;
+	double begin, elapsed;
+	int error;
+
+	if (!(X = hxd_open(&error)))
+		errx(EXIT_FAILURE, "%s", hxd_strerror(error));
+
+	if ((error = hxd_compile(X, fmt, flags)))
+		errx(EXIT_FAILURE, "%s: %s", name, hxd_strerror(error));
+
+	nalloc = hxd_nalloc;
+	begin = bench_now();
+
+	for (p = 0; p < size; p += len) {
+		len = MIN(bufsiz, size - p);
+
+		if ((error = hxd_write(X, &src[p], len)))
+			errx(EXIT_FAILURE, "%s: %s", name, hxd_strerror(error));
+
+		while ((n = hxd_read(X, buf, sizeof buf)))
+			out += n;
+	}
+
+	if ((error = hxd_flush(X)))
+		errx(EXIT_FAILURE, "%s: %s", name, hxd_strerror(error));
+
+	while ((n = hxd_read(X, buf, sizeof buf)))
+		out += n;
+
+	elapsed = bench_now() - begin;
+	nalloc = hxd_nalloc - nalloc;
+
+	printf("%-8s %-6s %7zu %10.2f %10.2f %10.1f %7lu\n",
+		name, (flags & HXD_BIG_ENDIAN)? "big" : "little", bufsiz,
+		size / elapsed / 1e6, out / elapsed / 1e6,
+		elapsed * 1e9 / ((size + hxd_blocksize(X) - 1) / hxd_blocksize(X)),
+		nalloc);
+
+	hxd_close(X);
+} /* bench_run() */
+
+
+static size_t bench_size(const char *arg) {
+	unsigned long lu;
+	char *end;
+
+	lu = strtoul(arg, &end, 0);
+
+	if (*end || !lu)
+		errx(EXIT_FAILURE, "%s: invalid size", arg);
+
+	return lu;
+} /* bench_size() */
+
+
+int main(int argc, char **argv) {
+	static const struct { const char *name, *fmt; } format[] = {
+		{ "b", HEXDUMP_b }, { "c", HEXDUMP_c }, { "C", HEXDUMP_C },
+		{ "d", HEXDUMP_d }, { "o", HEXDUMP_o }, { "x", HEXDUMP_x },
+		{ "i", HEXDUMP_i },
+		{ "x32", "\"%08.8_ax \" 4/4 \" %08x\" \"\\n\"" },
+		{ "x64", "\"%08.8_ax \" 2/8 \" %016x\" \"\\n\"" },
+		{ "d64", "\"%08.8_ax \" 2/8 \" %20d\" \"\\n\"" },
+		{ "f64", "\"%08.8_ax \" 2/8 \" %23.16e\" \"\\n\"" },
+		{ "f64f", "\"%08.8_ax \" 2/8 \" %.3f\" \"\\n\"" },
+		{ "p", "\"%08.8_ax \" 64/1 \"%_p\" \"\\n\"" },
+		{ "A", "\"%08.8_Ax\\n\"\n\"%08.8_ax \" 16/1 \"%02x \" \"\\n\"" },
+	};
+	static const size_t bufsiz[] = { 16, 4096, 65536 };
+	static const int order[] = { HXD_BIG_ENDIAN, HXD_LITTLE_ENDIAN };
+	const char *match = NULL;
+	unsigned char *src;
+	size_t size = 1 << 20, i, j, k;
+	unsigned long long r = 0x9e3779b97f4a7c15ULL;
+	int optc;
+
+	while (-1 != (optc = getopt(argc, argv, "m:n:h"))) {
+		switch (optc) {
+		case 'm':
+			match = optarg;
+
+			break;
+		case 'n':
+			size = bench_size(optarg);
+
+			break;
+		default:
+			fprintf(stderr,
+				"%s [-m NAME] [-n SIZE] [-h]\n" \
+				"  -m NAME  only run formats named NAME\n" \
+				"  -n SIZE  octets of input per run (default 1048576)\n" \
+				"  -h       print this usage message\n",
+				argv[0]);
+
+			return (optc == 'h')? 0 : EXIT_FAILURE;
+		}
+	}
+
+	if (!(src = malloc(size)))
+		err(EXIT_FAILURE, "malloc");
+
+	/* xorshift64 keeps the input identical between runs */
+	for (i = 0; i < size; i++) {
+		r ^= r << 13;
+		r ^= r >> 7;
+		r ^= r << 17;
+		src[i] = r >> 24;
+	}
+
+	printf("%-8s %-6s %7s %10s %10s %10s %7s\n",
+		"format", "order", "bufsiz", "MB/s in", "MB/s out", "ns/block", "allocs");
+
+	for (i = 0; i < countof(format); i++) {
+		if (match && strcmp(match, format[i].name))
+			continue;
+
+		for (j = 0; j < countof(order); j++) {
+			for (k = 0; k < countof(bufsiz); k++)
+				bench_run(format[i].name, format[i].fmt, order[j], src, size, bufsiz[k]);
+		}
+	}
+
+	free(src);
+
+	return 0;
+} /* main() */
+
+#endif /* HEXDUMP_BENCH */
@@ -26,6 +26,10 @@
 #ifndef HEXDUMP_H
 #define HEXDUMP_H
 
+#ifdef __cplusplus
+extern "C" {
+#endif
+
 
 /*
  * H E X D U M P  V E R S I O N  I N T E R F A C E S
@@ -37,7 +41,7 @@
 
 #define HXD_V_REL 0x20181221
 #define HXD_V_ABI 0x20130210
-#define HXD_V_API 0x20130412
+#define HXD_V_API 0x20261019
 
 int hxd_version(void);
 const char *hxd_vendor(void);
@@ -82,6 +86,10 @@ enum hxd_errors {
 	HXD_EOOPS,
 	/* something horrible happened */
 
+	HXD_EIMAGE,
+	/* hxd_load() was passed a corrupt image, or one saved by another
+	   version of the library */
+
 	HXD_ELAST
 }; /* enum hxd_errors */
 
@@ -109,24 +117,121 @@ void hxd_reset(struct hexdump *);
 #define HXD_BIG_ENDIAN     0x01
 #define HXD_LITTLE_ENDIAN  0x02
 #define HXD_NOPADDING      0x04
+#define HXD_REVERSE        0x08 /* hxd_write() text, hxd_read() octets */
+#define HXD_COLOR          0x10 /* ANSI colours by octet class */
+#define HXD_JSON           0x20 /* escape text conversions for JSON strings */
 
 hxd_error_t hxd_compile(struct hexdump *, const char *, int);
 
+/*
+ * Serialize the compiled program so hxd_load() can restore it without
+ * parsing the format again, e.g. from a cache on disk. hxd_save() returns
+ * the size of the image, copying it to the buffer only if it fits, like
+ * snprintf(3), or 0 if the context was compiled with HXD_REVERSE. Images
+ * are portable across byte orders but not across library versions, which
+ * hxd_load() rejects with HXD_EIMAGE. hxd_load() also verifies the code,
+ * so a forged image can't reach outside the machine, but it may still
+ * never finish; load only images you or the library wrote.
+ */
+size_t hxd_save(struct hexdump *, void *, size_t);
+
+hxd_error_t hxd_load(struct hexdump *, const void *, size_t);
+
 const char *hxd_help(struct hexdump *);
 
 size_t hxd_blocksize(struct hexdump *);
 
+/*
+ * Sets the address of the next block, so a context can format a slice of
+ * a larger stream. Octets already buffered are renumbered from it. No
+ * effect in reverse mode, where addresses are read from the text.
+ */
+void hxd_seek(struct hexdump *, size_t);
+
 hxd_error_t hxd_write(struct hexdump *, const void *, size_t);
 
+/*
+ * Like hxd_write() over a chain of segments. Blocks wholly within one
+ * segment are formatted in place, as hxd_write() does for its span; only
+ * blocks straddling segments are copied into the input buffer.
+ */
+#if !_WIN32
+struct iovec;
+
+hxd_error_t hxd_writev(struct hexdump *, const struct iovec *, int);
+#endif
+
 hxd_error_t hxd_flush(struct hexdump *);
 
 size_t hxd_read(struct hexdump *, void *, size_t);
 
+/*
+ * The output buffer grows as needed but is never shrunk implicitly.
+ * hxd_retain() sets a cap on the size kept once hxd_read() drains the
+ * buffer or hxd_reset() discards it; 0, the default, is no cap. Set it
+ * above the output typically buffered between reads to avoid repeated
+ * reallocation. hxd_trim() releases all memory not holding pending
+ * output, regardless of the cap.
+ */
+void hxd_retain(struct hexdump *, size_t);
+
+void hxd_trim(struct hexdump *);
+
+/*
+ * Formats into the caller's buffer of the given size rather than the
+ * context's own, e.g. a mapping of the output file, until called again.
+ * Output which doesn't fit fails with ENOBUFS; hxd_outsize() bounds the
+ * output of formatting and flushing n octets, or is SIZE_MAX if it can't.
+ * Returns the octets written to the buffer being replaced, which then
+ * belong to the caller, or 0 if that was the context's own, whose pending
+ * output is kept until it is restored by passing a NULL buffer.
+ */
+size_t hxd_setout(struct hexdump *, void *, size_t);
+
+size_t hxd_outsize(struct hexdump *, size_t);
+
+/*
+ * Counters accumulated over the life of the context; neither hxd_reset()
+ * nor hxd_compile() clears them. in and out count octets accepted by
+ * hxd_write() and returned by hxd_read(), blocks counts executions of the
+ * compiled format over a full or flushed partial block, reallocs counts
+ * growth of the output buffer and peak its largest size, and exectime is
+ * the wall-clock time, in nanoseconds, spent formatting.
+ */
+struct hxd_stats {
+	unsigned long long in, out;
+	unsigned long long blocks;
+	unsigned long long reallocs;
+	size_t peak;
+	unsigned long long exectime;
+}; /* struct hxd_stats */
+
+void hxd_stats(struct hexdump *, struct hxd_stats *);
+
+/*
+ * Formats the input descriptor to the output descriptor, like repeatedly
+ * calling hxd_write() and hxd_read(). *off octets are first skipped and at
+ * most *len octets formatted, both from the current position; each is
+ * decremented by the octets consumed, so the same pair can be passed over
+ * a sequence of files. Regular files are mapped rather than read unless
+ * HXD_DUMP_NOMMAP is set. HXD_DUMP_FLUSH calls hxd_flush() at the end, as
+ * for the last file. Output is drained before returning, except on error,
+ * or if formatted into a buffer set with hxd_setout(), where it is left.
+ */
+#if !_WIN32
+#define HXD_DUMP_FLUSH  0x01
+#define HXD_DUMP_NOMMAP 0x02
+
+hxd_error_t hxd_dump_fd(struct hexdump *, int, int, size_t *, size_t *, int);
+#endif
+
 
 /*
  * H E X D U M P  C O M M O N  F O R M A T S
  *
- * Predefined formats for hexdump(1) -b, -c, -C, -d, -o, -x, and xxd(1) -i.
+ * Predefined formats for hexdump(1) -b, -c, -C, -d, -o, -x, and xxd(1) -i,
+ * and newline-delimited JSON, one object per 16-octet block, to be compiled
+ * with HXD_JSON.
  *
  * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * */
 
@@ -140,6 +245,9 @@ size_t hxd_read(struct hexdump *, void *, size_t);
 
 #define HEXDUMP_i "\"  \" 12/1? \"0x%02x, \" \"\\n\""
 
+#define HEXDUMP_J "\"{\\\"addr\\\":%_ad,\\\"hex\\\":\\\"\" 16/1 \"%02x\" \"\\\",\"\n" \
+                  "\"\\\"ascii\\\":\\\"\" 16/1 \"%_p\" \"\\\"}\\n\""
+
 
 /*
  * H E X D U M P  L U A  I N T E R F A C E S
@@ -160,21 +268,58 @@ size_t hxd_read(struct hexdump *, void *, size_t);
  *     Bitwise flag which disables padding; instead, formatting units are
  *     skipped entirely when the block buffer is too short.
  *
+ *   hexdump.REVERSE
+ *     Bitwise flag which compiles the format in reverse: text formatted
+ *     with it is written, and the original octets are read back.
+ *
+ *   hexdump.COLOR
+ *     Bitwise flag which colours single-octet conversions by the class of
+ *     the octet (NUL, printable, whitespace, control, or high bit) with
+ *     ANSI escape sequences.
+ *
+ *   hexdump.JSON
+ *     Bitwise flag which escapes the output of text conversions (%c, %s,
+ *     %_c, %_p, and %_u) for use inside a JSON string, dropping their
+ *     padding. Can't be combined with REVERSE or COLOR.
+ *
  *   hexdump.b 
  *   hexdump.c
  *   hexdump.C
  *   hexdump.d
  *   hexdump.o
  *   hexdump.x
- *     Predefined format strings of the hexdump(1) options -x, -c, -C, -d,
+ *     Predefined format strings of the hexdump(1) options -b, -c, -C, -d,
  *     -o, and -x, respectively.
  *
+ *   hexdump.i
+ *     Predefined format string of -i, a C array initializer like xxd -i.
+ *
+ *   hexdump.J
+ *     Predefined format string of -J, one JSON object per 16-octet block.
+ *     Compile it with hexdump.JSON.
+ *
  *   hexdump.new()
  *     Returns new context, just like hxd_open.
  *
  *   hexdump.apply(fmt:string, [flags:int,] data:string, ...)
  *     Returns a formatted string, memoizing the context object for later
- *     reuse with the same format.
+ *     reuse with the same format. Each data string is formatted in a
+ *     single pass, so large strings needn't be split by the caller.
+ *
+ *   hexdump.lines(fmt:string, [flags:int,] file:file|int)
+ *     Returns an iterator which reads the Lua file handle or integer file
+ *     descriptor to EOF, yielding formatted output in chunks of roughly
+ *     64KB. Memory use is bounded regardless of the size of the file. The
+ *     memoized context of .apply is reused, and returned to the cache once
+ *     the iterator is exhausted.
+ *
+ *   hexdump.cache([capacity:int])
+ *     Returns a table describing the cache of memoized contexts used by
+ *     .apply and .lines, with the fields capacity, count, hits, misses,
+ *     and evictions. If capacity is given the cache is first resized,
+ *     evicting the least recently used contexts as necessary. A capacity
+ *     of 0 disables memoization. The default capacity is 64, and the
+ *     output buffers of cached contexts are shrunk to 4KB.
  *
  * The module table also has a __call metamethod, which forwards to .apply.
  * This allows doing require"hexdump"('/1 "%.2x"', "0123456789").
@@ -189,9 +334,20 @@ size_t hxd_read(struct hexdump *, void *, size_t);
  *     Parses and compiles the format string according to the rules of BSD
  *     hexdump(1). Returns true on success, or throws an error on failure.
  *
+ *   :save()
+ *     Returns the compiled program as a string, like hxd_save, or throws
+ *     an error if the format was compiled in reverse mode.
+ *
+ *   :load(image:string)
+ *     Restores a program saved by :save, like hxd_load. Returns true on
+ *     success, or throws an error on failure.
+ *
  *   :blocksize()
  *     Returns the block size of any compiled format string.
  *
+ *   :seek(address:int)
+ *     Sets the address of the next block, like hxd_seek. Returns true.
+ *
  *   :write(data:string)
  *     Processes the data string. The string DOES NOT have to be the same
  *     length as the block size. It can be any size, although the formatted
@@ -206,10 +362,34 @@ size_t hxd_read(struct hexdump *, void *, size_t);
  *
  *   :read()
  *     Drains and returns the output buffer as a string.
+ *
+ *   :retain(size:int)
+ *     Caps the output buffer memory kept after draining, like
+ *     hxd_retain. Returns true.
+ *
+ *   :trim()
+ *     Releases output buffer memory not holding pending output. Returns
+ *     true.
+ *
+ *   :stats()
+ *     Returns a table with the fields of struct hxd_stats. exectime is
+ *     in seconds.
+ *
+ *   :stream(file:file|int)
+ *     Like hexdump.lines, but using the context's compiled format. The
+ *     input buffer is flushed at EOF.
+ *
+ *   :dump(in:file|int, out:file|int[, offset:int[, length:int]])
+ *     Formats in to out with hxd_dump_fd, flushing at EOF. Returns the
+ *     number of octets formatted. Not available on Windows.
  * 
  * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * */
 
 int luaopen_hexdump(/* pointer to lua_State */);
 
 
+#ifdef __cplusplus
+} /* extern "C" */
+#endif
+
 #endif /* HEXDUMP_H */
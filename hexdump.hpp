@@ -0,0 +1,332 @@
+/* ==========================================================================
+ * hexdump.hpp - hexdump.c
+ * --------------------------------------------------------------------------
+ * Copyright (c) 2013  William Ahern
+ *
+ * Permission is hereby granted, free of charge, to any person obtaining a
+ * copy of this software and associated documentation files (the
+ * "Software"), to deal in the Software without restriction, including
+ * without limitation the rights to use, copy, modify, merge, publish,
+ * distribute, sublicense, and/or sell copies of the Software, and to permit
+ * persons to whom the Software is furnished to do so, subject to the
+ * following conditions:
+ *
+ * The above copyright notice and this permission notice shall be included
+ * in all copies or substantial portions of the Software.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS
+ * OR IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF
+ * MERCHANTABILITY, FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN
+ * NO EVENT SHALL THE AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM,
+ * DAMAGES OR OTHER LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR
+ * OTHERWISE, ARISING FROM, OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE
+ * USE OR OTHER DEALINGS IN THE SOFTWARE.
+ * ==========================================================================
+ */
+#ifndef HEXDUMP_HPP
+#define HEXDUMP_HPP
+
+/*
+ * C++20 interface to hexdump.c, header only. Errors are thrown as
+ * hxd::error, carrying the hxd_error_t.
+ *
+ *   hxd::context X(HEXDUMP_C);
+ *   std::string out = X(data);
+ *
+ *   using dump = hxd::format<"16/1 \"%02x\" \"\\n\"">;
+ *   std::string out = dump::apply(data);
+ *
+ * A hxd::format is checked at compile time and compiled at most once
+ * per process; every context made from it loads the saved program with
+ * hxd_load() rather than parsing the format again. For code with no
+ * compilation or interpretation at all, see `hexdump -G`.
+ */
+
+#include <algorithm>   /* std::max */
+#include <cstddef>     /* std::byte std::size_t */
+#include <span>        /* std::span */
+#include <stdexcept>   /* std::runtime_error */
+#include <string>      /* std::string */
+#include <string_view> /* std::string_view */
+#include <utility>     /* std::exchange */
+
+#include "hexdump.h"
+
+
+namespace hxd {
+
+class error : public std::runtime_error {
+public:
+	explicit error(hxd_error_t code)
+		: std::runtime_error(hxd_strerror(code)), code_(code) {}
+
+	hxd_error_t code() const noexcept { return code_; }
+
+private:
+	hxd_error_t code_;
+}; /* class error */
+
+
+inline constexpr int native = HXD_NATIVE;
+inline constexpr int network = HXD_NETWORK;
+inline constexpr int big_endian = HXD_BIG_ENDIAN;
+inline constexpr int little_endian = HXD_LITTLE_ENDIAN;
+inline constexpr int nopadding = HXD_NOPADDING;
+inline constexpr int reverse = HXD_REVERSE;
+inline constexpr int color = HXD_COLOR;
+inline constexpr int json = HXD_JSON;
+
+
+/*
+ * Move-only owner of a struct hexdump. Output is appended to the caller's
+ * string, read straight from the context's buffer into the string's.
+ */
+class context {
+public:
+	context() {
+		hxd_error_t code = 0;
+
+		if (!(X = hxd_open(&code)))
+			throw error(code);
+	}
+
+	explicit context(std::string_view fmt, int flags = 0) : context() {
+		compile(fmt, flags);
+	}
+
+	context(context &&other) noexcept : X(std::exchange(other.X, nullptr)) {}
+
+	context &operator=(context &&other) noexcept {
+		if (this != &other) {
+			hxd_close(X);
+			X = std::exchange(other.X, nullptr);
+		}
+
+		return *this;
+	}
+
+	context(const context &) = delete;
+	context &operator=(const context &) = delete;
+
+	~context() { hxd_close(X); }
+
+	struct hexdump *get() const noexcept { return X; }
+
+	void compile(std::string_view fmt, int flags = 0) {
+		check(hxd_compile(X, std::string(fmt).c_str(), flags));
+	}
+
+	/* the compiled program, or an empty string in reverse mode */
+	std::string save() const {
+		std::string image(hxd_save(X, nullptr, 0), '\0');
+
+		hxd_save(X, image.data(), image.size());
+
+		return image;
+	}
+
+	void load(std::string_view image) {
+		check(hxd_load(X, image.data(), image.size()));
+	}
+
+	std::size_t blocksize() const noexcept { return hxd_blocksize(X); }
+
+	void reset() noexcept { hxd_reset(X); }
+
+	void seek(std::size_t address) noexcept { hxd_seek(X, address); }
+
+	void write(std::string_view data) {
+		check(hxd_write(X, data.data(), data.size()));
+	}
+
+	void write(std::span<const std::byte> data) {
+		check(hxd_write(X, data.data(), data.size()));
+	}
+
+	void write(std::span<const unsigned char> data) {
+		check(hxd_write(X, data.data(), data.size()));
+	}
+
+	void flush() { check(hxd_flush(X)); }
+
+	/* drain into dst, returning the octets copied */
+	std::size_t read(std::span<char> dst) noexcept {
+		return hxd_read(X, dst.data(), dst.size());
+	}
+
+	/* drain all pending output onto the end of out */
+	std::string &read(std::string &out) {
+		std::size_t p, n;
+		bool full;
+
+		do {
+			p = out.size();
+			out.resize(std::max(out.capacity(), p + 4096));
+			n = hxd_read(X, &out[p], out.size() - p);
+			full = (n == out.size() - p);
+			out.resize(p + n);
+		} while (full);
+
+		return out;
+	}
+
+	/* format data as a whole, like the Lua hexdump.apply */
+	std::string &operator()(std::string_view data, std::string &out) {
+		reset();
+		write(data);
+		flush();
+
+		return read(out);
+	}
+
+	std::string operator()(std::string_view data) {
+		std::string out;
+
+		return std::move((*this)(data, out));
+	}
+
+	void retain(std::size_t lim) noexcept { hxd_retain(X, lim); }
+
+	void trim() noexcept { hxd_trim(X); }
+
+	/* format into dst, returning the octets written to the buffer replaced */
+	std::size_t setout(std::span<char> dst) noexcept {
+		return hxd_setout(X, dst.data(), dst.size());
+	}
+
+	/* back to the context's own buffer */
+	std::size_t setout() noexcept { return hxd_setout(X, nullptr, 0); }
+
+	std::size_t outsize(std::size_t len) const noexcept { return hxd_outsize(X, len); }
+
+	struct hxd_stats stats() const noexcept {
+		struct hxd_stats st;
+
+		hxd_stats(X, &st);
+
+		return st;
+	}
+
+private:
+	struct hexdump *X = nullptr;
+
+	static void check(hxd_error_t code) {
+		if (code)
+			throw error(code);
+	}
+}; /* class context */
+
+
+/* a string literal usable as a template argument */
+template <std::size_t N>
+struct fixed_string {
+	char str[N] {};
+
+	constexpr fixed_string(const char (&s)[N]) {
+		for (std::size_t i = 0; i < N; i++)
+			str[i] = s[i];
+	}
+
+	constexpr std::string_view view() const { return { str, N - 1 }; }
+}; /* struct fixed_string */
+
+
+namespace detail {
+
+/* every quoted string is terminated, honoring backslash escapes */
+constexpr bool terminated(std::string_view fmt) {
+	bool quoted = false;
+
+	for (std::size_t i = 0; i < fmt.size(); i++) {
+		if (quoted && fmt[i] == '\\')
+			i++;
+		else if (fmt[i] == '"')
+			quoted = !quoted;
+	}
+
+	return !quoted;
+} /* terminated() */
+
+/* every conversion in a quoted string ends in a conversion character */
+constexpr bool converts(std::string_view fmt) {
+	constexpr std::string_view prefix = "-+ #0123456789.";
+	constexpr std::string_view plain = "cdiouxXeEfgGs%";
+	bool quoted = false;
+	std::size_t i = 0;
+
+	while (i < fmt.size()) {
+		char ch = fmt[i++];
+
+		if (quoted && ch == '\\') {
+			i++;
+		} else if (ch == '"') {
+			quoted = !quoted;
+		} else if (quoted && ch == '%') {
+			while (i < fmt.size() && prefix.find(fmt[i]) != prefix.npos)
+				i++;
+
+			if (i >= fmt.size())
+				return false;
+
+			if (fmt[i] == '_') {
+				if (++i >= fmt.size())
+					return false;
+
+				if (fmt[i] == 'a' || fmt[i] == 'A') {
+					if (++i >= fmt.size() || std::string_view("dox").find(fmt[i]) == std::string_view::npos)
+						return false;
+				} else if (std::string_view("cpu").find(fmt[i]) == std::string_view::npos) {
+					return false;
+				}
+			} else if (plain.find(fmt[i]) == plain.npos) {
+				return false;
+			}
+
+			i++;
+		}
+	}
+
+	return true;
+} /* converts() */
+
+} /* namespace detail */
+
+
+/*
+ * A format fixed at compile time. Malformed quoting and conversion
+ * characters are rejected by the compiler; anything subtler surfaces as
+ * hxd::error the first time the format is used.
+ */
+template <fixed_string Fmt, int Flags = 0>
+class format {
+	static_assert(detail::terminated(Fmt.view()), "hxd::format: unterminated quoted string");
+	static_assert(detail::converts(Fmt.view()), "hxd::format: unknown conversion character");
+
+public:
+	static constexpr std::string_view string = Fmt.view();
+	static constexpr int flags = Flags;
+
+	/* a new context running the format */
+	static context make() {
+		static const std::string image = context(string, Flags).save();
+		context X;
+
+		if (image.empty())
+			X.compile(string, Flags);
+		else
+			X.load(image);
+
+		return X;
+	}
+
+	/* format data as a whole with a per-thread context */
+	static std::string apply(std::string_view data) {
+		thread_local context X = make();
+
+		return X(data);
+	}
+}; /* class format */
+
+} /* namespace hxd */
+
+#endif /* HEXDUMP_HPP */